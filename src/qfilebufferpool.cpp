@@ -0,0 +1,201 @@
+#include "qfilebufferpool_p.h"
+
+#ifdef Q_OS_LINUX
+#include <sys/mman.h>
+#endif
+
+static const int pageSize = 4*1024;
+static const int hugePageSize = 2*1024*1024;
+
+Q_GLOBAL_STATIC(QFileBufferPool, bufferPool)
+
+QFileBufferPool::QFileBufferPool() :
+    m_bufferSize(64*1024),
+    m_memoryLimit(64*1024*1024),
+    m_allocated(0),
+    m_hugePages(false)
+{
+}
+
+QFileBufferPool::~QFileBufferPool()
+{
+    foreach (const PoolBuffer &buffer, m_free)
+        free(buffer);
+}
+
+QFileBufferPool *QFileBufferPool::instance()
+{
+    return bufferPool();
+}
+
+int QFileBufferPool::bufferSize() const
+{
+    QMutexLocker l(&m_mutex);
+    return m_bufferSize;
+}
+
+/*!
+  \internal
+
+    Sets \a size of buffers given from now on, rounded up to whole pages. Buffers of previous
+    size are freed when they are returned.
+*/
+void QFileBufferPool::setBufferSize(int size)
+{
+    QMutexLocker l(&m_mutex);
+    m_bufferSize = qMax(pageSize, (size + pageSize - 1) / pageSize * pageSize);
+    m_memoryLimit = qMax(m_memoryLimit, qint64(m_bufferSize));
+    trim();
+}
+
+qint64 QFileBufferPool::memoryLimit() const
+{
+    QMutexLocker l(&m_mutex);
+    return m_memoryLimit;
+}
+
+/*!
+  \internal
+
+    Sets maximum memory used by all buffers; at least one buffer is always allowed.
+*/
+void QFileBufferPool::setMemoryLimit(qint64 limit)
+{
+    QMutexLocker l(&m_mutex);
+    m_memoryLimit = qMax(limit, qint64(m_bufferSize));
+    trim();
+    m_released.wakeAll();
+}
+
+bool QFileBufferPool::hugePagesEnabled() const
+{
+    QMutexLocker l(&m_mutex);
+    return m_hugePages;
+}
+
+void QFileBufferPool::setHugePagesEnabled(bool on)
+{
+    QMutexLocker l(&m_mutex);
+    m_hugePages = on;
+}
+
+qint64 QFileBufferPool::allocatedMemory() const
+{
+    QMutexLocker l(&m_mutex);
+    return m_allocated;
+}
+
+/*!
+  \internal
+
+    Returns free buffer of current size, allocating one if memory limit allows it; otherwise
+    waits until another thread releases one. Returns null buffer if allocation fails.
+
+    Thread which already holds a buffer gets the same one again instead: it could be waiting
+    for itself, e.g. when a preempting request is copied while the preempted one holds its
+    buffer. Callers must not keep data in the buffer across preemption points, so the limit
+    is never exceeded.
+*/
+PoolBuffer QFileBufferPool::acquire()
+{
+    QMutexLocker l(&m_mutex);
+    Qt::HANDLE thread = QThread::currentThreadId();
+    QHash<Qt::HANDLE, HeldBuffer>::iterator held = m_held.find(thread);
+    if (held == m_held.end()) {
+        while (m_free.isEmpty() && m_allocated + m_bufferSize > m_memoryLimit)
+            m_released.wait(&m_mutex);
+
+        PoolBuffer buffer = take();
+        if (!buffer.data)
+            return buffer;
+        held = m_held.insert(thread, HeldBuffer());
+        held.value().buffer = buffer;
+    }
+    held.value().count++;
+    return held.value().buffer;
+}
+
+/*!
+  \internal
+
+    Returns another buffer distinct from the one held by current thread, or null buffer if
+    none is free and memory limit does not allow allocating one; never waits.
+*/
+PoolBuffer QFileBufferPool::tryAcquire()
+{
+    QMutexLocker l(&m_mutex);
+    if (m_free.isEmpty() && m_allocated + m_bufferSize > m_memoryLimit)
+        return PoolBuffer();
+    return take();
+}
+
+void QFileBufferPool::release(const PoolBuffer &buffer)
+{
+    if (!buffer.data)
+        return;
+
+    QMutexLocker l(&m_mutex);
+    QHash<Qt::HANDLE, HeldBuffer>::iterator held = m_held.find(QThread::currentThreadId());
+    if (held != m_held.end() && held.value().buffer.data == buffer.data) {
+        if (--held.value().count > 0)
+            return;
+        m_held.erase(held);
+    }
+
+    if (buffer.size == m_bufferSize && m_allocated <= m_memoryLimit)
+        m_free.append(buffer);
+    else
+        free(buffer);
+    m_released.wakeOne();
+}
+
+PoolBuffer QFileBufferPool::take()
+{
+    if (!m_free.isEmpty())
+        return m_free.takeLast();
+    return allocate(m_bufferSize);
+}
+
+/*!
+  \internal
+
+    Allocates page aligned buffer, which is also suitable for unbuffered I/O. With huge pages
+    enabled, large buffers are aligned to huge page and marked for transparent huge pages.
+*/
+PoolBuffer QFileBufferPool::allocate(int size)
+{
+    bool huge = m_hugePages && size >= hugePageSize;
+
+    PoolBuffer buffer;
+    buffer.data = static_cast<char *>(qMallocAligned(size, huge ? hugePageSize : pageSize));
+    if (!buffer.data)
+        return buffer;
+
+#if defined(Q_OS_LINUX) && defined(MADV_HUGEPAGE)
+    if (huge)
+        ::madvise(buffer.data, size, MADV_HUGEPAGE);
+#endif
+
+    buffer.size = size;
+    m_allocated += size;
+    return buffer;
+}
+
+void QFileBufferPool::free(const PoolBuffer &buffer)
+{
+    qFreeAligned(buffer.data);
+    m_allocated -= buffer.size;
+}
+
+/*!
+  \internal
+
+    Frees cached buffers of old size or above the memory limit.
+*/
+void QFileBufferPool::trim()
+{
+    for (int i = m_free.size() - 1; i >= 0; i--) {
+        if (m_free.at(i).size != m_bufferSize || m_allocated > m_memoryLimit)
+            free(m_free.takeAt(i));
+    }
+}
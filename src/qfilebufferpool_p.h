@@ -0,0 +1,83 @@
+#ifndef QFILEBUFFERPOOL_P_H
+#define QFILEBUFFERPOOL_P_H
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QThread>
+#include <QtCore/QWaitCondition>
+
+struct PoolBuffer
+{
+    PoolBuffer() : data(0), size(0) {}
+
+    char *data;
+    int size;
+};
+
+class QFileBufferPool
+{
+public:
+    QFileBufferPool();
+    ~QFileBufferPool();
+
+    static QFileBufferPool *instance();
+
+    int bufferSize() const;
+    void setBufferSize(int size);
+    qint64 memoryLimit() const;
+    void setMemoryLimit(qint64 limit);
+    bool hugePagesEnabled() const;
+    void setHugePagesEnabled(bool on);
+    qint64 allocatedMemory() const;
+
+    PoolBuffer acquire();
+    PoolBuffer tryAcquire();
+    void release(const PoolBuffer &buffer);
+
+private:
+    struct HeldBuffer
+    {
+        HeldBuffer() : count(0) {}
+
+        PoolBuffer buffer;
+        int count;
+    };
+
+    PoolBuffer take();
+    PoolBuffer allocate(int size);
+    void free(const PoolBuffer &buffer);
+    void trim();
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_released;
+    QList<PoolBuffer> m_free;
+    QHash<Qt::HANDLE, HeldBuffer> m_held; // buffer shared by nested acquire() of each thread
+    int m_bufferSize;
+    qint64 m_memoryLimit;
+    qint64 m_allocated;
+    bool m_hugePages;
+};
+
+/*!
+  \internal
+
+    Buffer borrowed from the process-wide pool for the lifetime of the object; it must be
+    destroyed by the thread which created it. data() is null if the buffer cannot be allocated.
+*/
+class PooledBuffer
+{
+public:
+    PooledBuffer() : m_buffer(QFileBufferPool::instance()->acquire()) {}
+    ~PooledBuffer() { QFileBufferPool::instance()->release(m_buffer); }
+
+    char *data() const { return m_buffer.data; }
+    int size() const { return m_buffer.size; }
+
+private:
+    PoolBuffer m_buffer;
+
+    Q_DISABLE_COPY(PooledBuffer)
+};
+
+#endif // QFILEBUFFERPOOL_P_H
@@ -1,984 +1,4006 @@
 #include "qfilecopier_p.h"
+#include "qfilebufferpool_p.h"
+#include "qfileremover_p.h"
+#include "qfilereplicator_p.h"
 
 #include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QMetaType>
 
+#include <limits.h>
+#include <new>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
 Q_DECLARE_METATYPE(QFileCopier::State)
 Q_DECLARE_METATYPE(QFileCopier::Error)
 
-static bool removePath(const QString &path)
+/*!
+  \internal
+
+    Measures one call of a \a phase made for request \a id; does nothing but checking a flag
+    when statistics are disabled.
+*/
+class PhaseTimer
 {
-    bool result = true;
-    QFileInfo info(path);
-    if (info.isDir()) {
-        QDir dir(path);
-        foreach (const QString &entry, dir.entryList(QDir::AllDirs | QDir::Files | QDir::Hidden | QDir::NoDotAndDotDot)) {
-            result &= removePath(dir.absoluteFilePath(entry));
-        }
-        if (!info.dir().rmdir(info.fileName()))
-            return false;
-    } else {
-        result = QFile::remove(path);
+public:
+    PhaseTimer(QFileCopierThread *thread, int id, QFileCopier::Phase phase) :
+        m_thread(thread->statisticsEnabled() ? thread : 0), m_id(id), m_phase(phase), m_bytes(0)
+    {
+        if (m_thread)
+            m_timer.start();
     }
-    return result;
-}
 
-QFileCopierThread::QFileCopierThread(QObject *parent) :
-    QThread(parent),
-    lock(QReadWriteLock::Recursive),
-    m_currentId(-1),
-    m_state(QFileCopier::Idle),
-    shouldEmitProgress(false),
-    waitingForInteraction(false),
-    stopRequest(false),
-    skipAllRequest(false),
-    cancelAllRequest(false),
-    overwriteAllRequest(false),
-    renameAllRequest(false),
-    mergeAllRequest(false),
-    hasError(true),
-    m_totalProgress(0),
-    m_totalSize(0),
-    autoReset(true)
+    ~PhaseTimer()
+    {
+        if (m_thread)
+            m_thread->addStatistics(m_id, m_phase, m_timer.nsecsElapsed(), m_bytes);
+    }
+
+    void setId(int id) { m_id = id; }
+    void setBytes(qint64 bytes) { m_bytes = bytes; }
+
+private:
+    QFileCopierThread *m_thread;
+    QElapsedTimer m_timer;
+    int m_id;
+    QFileCopier::Phase m_phase;
+    qint64 m_bytes;
+};
+
+// path removed in background is already gone, so only removal in place can be canceled
+static bool removePath(const QString &path, QFileCopier::CopyFlags flags, const CancelToken *token = 0)
 {
+    if (flags & QFileCopier::RemoveInBackground)
+        return QFileRemover::removePathInBackground(path);
+
+    return QFileRemover::removePath(path, token);
 }
 
-QFileCopierThread::~QFileCopierThread()
+/*!
+  \internal
+
+    Returns true if \a path is a file with more than one hard link and sets \a id.
+*/
+static bool hardLinkedFileId(const QString &path, FileId *id)
 {
-    stopRequest = true;
-    cancel();
-    lock.lockForWrite();
-    newCopyCondition.wakeOne();
-    lock.unlock();
-    wait();
+#ifdef Q_OS_UNIX
+    struct stat st;
+    if (::lstat(QFile::encodeName(path).constData(), &st) != 0 || S_ISDIR(st.st_mode) || st.st_nlink < 2)
+        return false;
+
+    *id = qMakePair(quint64(st.st_dev), quint64(st.st_ino));
+    return true;
+#else
+    Q_UNUSED(path);
+    Q_UNUSED(id);
+    return false;
+#endif
 }
 
-void QFileCopierThread::enqueueTaskList(const QList<Task> &list)
+static bool createHardLink(const QString &source, const QString &dest)
 {
-    QWriteLocker l(&lock);
-    taskQueue.append(list);
-    restart();
+#if defined(Q_OS_UNIX)
+    // links are not followed, so symbolic link is linked itself
+    return ::linkat(AT_FDCWD, QFile::encodeName(source).constData(),
+                    AT_FDCWD, QFile::encodeName(dest).constData(), 0) == 0;
+#elif defined(Q_OS_WIN)
+    return ::CreateHardLinkW((const wchar_t *)QDir::toNativeSeparators(dest).utf16(),
+                             (const wchar_t *)QDir::toNativeSeparators(source).utf16(), 0);
+#else
+    Q_UNUSED(source);
+    Q_UNUSED(dest);
+    return false;
+#endif
 }
 
-QList<int> QFileCopierThread::pendingRequests(int id) const
+/*!
+  \internal
+
+    Creates \a dest sharing data blocks with \a source (reflink); only some file systems
+    support it.
+*/
+static bool cloneFile(const QString &source, const QString &dest)
 {
-    int size = 0;
-    {
-        QReadLocker l(&lock);
-        size = requests.size();
-    }
-    QList<int> result;
-    for ( ; id < size; id++) {
-        result.append(id);
+#ifdef Q_OS_LINUX
+    int sourceFd = ::open(QFile::encodeName(source).constData(), O_RDONLY | O_CLOEXEC);
+    if (sourceFd == -1)
+        return false;
+
+    QByteArray nativeDest = QFile::encodeName(dest);
+    int destFd = ::open(nativeDest.constData(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (destFd == -1) {
+        ::close(sourceFd);
+        return false;
     }
+
+    bool result = ::ioctl(destFd, FICLONE, sourceFd) == 0;
+    ::close(destFd);
+    ::close(sourceFd);
+    if (!result)
+        ::unlink(nativeDest.constData());
     return result;
+#else
+    Q_UNUSED(source);
+    Q_UNUSED(dest);
+    return false;
+#endif
 }
 
-QList<int> QFileCopierThread::topRequests() const
+static bool replaceFile(const QString &source, const QString &dest)
 {
-    QReadLocker l(&lock);
-    return topRequestsList;
+#ifdef Q_OS_UNIX
+    return ::rename(QFile::encodeName(source).constData(), QFile::encodeName(dest).constData()) == 0;
+#else
+    return QFile::remove(dest) && QFile::rename(source, dest);
+#endif
 }
 
-QFileCopier::State QFileCopierThread::state() const
+/*!
+  \internal
+
+    Stores device of directory \a path into \a device. Directory (and maybe its parents) may
+    not exist yet, so nearest existing ancestor is checked.
+*/
+static bool directoryDevice(const QString &path, quint64 *device)
 {
-    return m_state;
+#ifdef Q_OS_UNIX
+    struct stat dirStat;
+    QString dir = path;
+    while (::stat(QFile::encodeName(dir).constData(), &dirStat) != 0) {
+        QString parentDir = QFileInfo(dir).absolutePath();
+        if (parentDir == dir)
+            return false;
+        dir = parentDir;
+    }
+
+    *device = dirStat.st_dev;
+    return true;
+#else
+    *device = qHash(QFileInfo(path).absoluteFilePath().left(2).toLower());
+    return true;
+#endif
 }
 
-void QFileCopierThread::setState(QFileCopier::State state)
-{
-    QWriteLocker l(&lock);
+/*!
+  \internal
 
-    m_state = state;
-    emit stateChanged(m_state);
+    Returns true if \a source can be renamed into directory which resides on \a device.
+*/
+static bool isSameDevice(const QString &source, quint64 device)
+{
+#ifdef Q_OS_UNIX
+    struct stat sourceStat;
+    return ::lstat(QFile::encodeName(source).constData(), &sourceStat) == 0 && quint64(sourceStat.st_dev) == device;
+#else
+    return qHash(QFileInfo(source).absoluteFilePath().left(2).toLower()) == device;
+#endif
 }
 
-Request QFileCopierThread::request(int id) const
+/*!
+  \internal
+
+    Returns true if mirrored \a dest needs not to be copied again. Copies get new modification
+    time, so file modified later than its source and of the same size is up to date.
+*/
+static bool isUpToDate(const QFileInfo &source, const QFileInfo &dest)
 {
-    QReadLocker l(&lock);
-    return requests.value(id);
+    if (source.isSymLink() || dest.isSymLink())
+        return source.isSymLink() && dest.isSymLink() && source.symLinkTarget() == dest.symLinkTarget();
+
+    return !source.isDir() && !dest.isDir()
+            && source.size() == dest.size() && !(dest.lastModified() < source.lastModified());
 }
 
-int QFileCopierThread::count() const
+/*!
+  \internal
+
+    Adds stale entry \a path of mirrored destination, or its parts, to \a paths to remove.
+    Entries excluded by \a filter are kept at any depth, and so are directories containing
+    them; other entries are removed as a whole. Returns false if anything in \a path is kept.
+*/
+bool addStaleEntry(const QString &path, const FileFilter &filter, QStringList *paths)
 {
-    QReadLocker l(&lock);
-    return requests.size();
+    QFileInfo info(path);
+    if (!info.isDir() || info.isSymLink()) {
+        paths->append(path);
+        return true;
+    }
+
+    bool whole = true;
+    QStringList parts;
+    QDirIterator i(path, QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot);
+    while (i.hasNext()) {
+        i.next();
+        if (filter.isExcluded(i.fileName()) || !addStaleEntry(i.filePath(), filter, &parts))
+            whole = false;
+    }
+
+    if (whole)
+        paths->append(path);
+    else
+        *paths += parts;
+    return whole;
 }
 
-qint64 QFileCopierThread::totalProgress() const
+/*!
+  \internal
+
+    Returns \a dest if it does not exist, otherwise first free path made by numbering its
+    base name.
+*/
+static QString renamedPath(const QString &dest)
 {
-    QReadLocker l(&lock);
-    return m_totalProgress;
+    int i = 0;
+    QString result = dest;
+    while (QFileInfo(result).exists()) {
+        QFileInfo destInfo(dest);
+
+#ifndef Q_CC_MSVC
+#warning "Uses mimetypes to determine type and extension"
+#endif
+        result = destInfo.absolutePath() + QLatin1Char('/') + destInfo.completeBaseName() + QLatin1Char(' ') + QString::number(++i);
+        if (!destInfo.suffix().isEmpty()) {
+            result += '.' + destInfo.suffix();
+        }
+    }
+    return result;
 }
 
-qint64 QFileCopierThread::totalSize() const
+static const quint32 manifestMagic = 0x51464d46; // "QFMF"
+static const quint32 manifestVersion = 1;
+
+enum ManifestFlag {
+    ManifestIsDir = 0x01,
+    ManifestSameDevice = 0x02,
+    ManifestOverwrite = 0x04,
+    ManifestMerge = 0x08,
+    ManifestRelativeSource = 0x10, // only file name is stored, path of parent is prepended
+    ManifestRelativeDest = 0x20
+};
+
+/*!
+  \internal
+
+    Reads requests written by QFileCopierThread::saveManifest(); parents and linked requests
+    are indexes in \a list. Returns false if the manifest is damaged.
+*/
+static bool readManifest(QDataStream &in, QList<Request> *list)
 {
-    QReadLocker l(&lock);
-    return m_totalSize;
+    quint32 magic = 0;
+    quint32 version = 0;
+    in >> magic >> version;
+    if (in.status() != QDataStream::Ok || magic != manifestMagic || version != manifestVersion)
+        return false;
+    in.setVersion(QDataStream::Qt_4_6);
+
+    qint32 count = 0;
+    in >> count;
+    for (int i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        quint8 type, flags;
+        qint32 copyFlags, parent, linkTo;
+        qint64 size;
+        QString source, dest;
+        in >> type >> flags >> copyFlags >> parent >> linkTo >> size >> source >> dest;
+
+        // relative destination is made of the source name, so it is never stored alone
+        bool relative = flags & (ManifestRelativeSource | ManifestRelativeDest);
+        if (type > Task::HardLink || parent < -1 || parent >= i || linkTo < -1 || linkTo >= count
+                || (relative && parent == -1)
+                || ((flags & ManifestRelativeDest) && !(flags & ManifestRelativeSource)))
+            return false;
+
+        Request r;
+        r.type = Task::Type(type);
+        r.source = flags & ManifestRelativeSource ? list->at(parent).source + QLatin1Char('/') + source : source;
+        r.dest = flags & ManifestRelativeDest ? list->at(parent).dest + QLatin1Char('/') + source : dest;
+        r.copyFlags = QFileCopier::CopyFlags(copyFlags);
+        r.parent = parent;
+        r.linkTo = linkTo;
+        r.size = size;
+        r.isDir = flags & ManifestIsDir;
+        r.sameDevice = flags & ManifestSameDevice;
+        r.overwrite = flags & ManifestOverwrite;
+        r.merge = flags & ManifestMerge;
+        list->append(r);
+    }
+    return in.status() == QDataStream::Ok;
 }
 
-void QFileCopierThread::setAutoReset(bool on)
+static const int listBatchSize = 1024; // tasks and top requests pending for a job read from a list
+
+TaskReader::TaskReader(QIODevice *device, QFileCopier::ListOptions options, const Task &task) :
+    m_device(device),
+    m_options(options),
+    m_task(task),
+    m_position(0),
+    m_atEnd(false),
+    m_unpaired(false)
 {
-    QWriteLocker l(&lock);
-    autoReset = on;
 }
 
-void QFileCopierThread::waitForFinished(unsigned long msecs)
+/*!
+  \internal
+
+    Reads next path and, with DestinationPairs, its destination into \a t; empty entries are
+    skipped. Returns false at the end of the list; a source left without destination is kept
+    for takeUnpaired().
+*/
+bool TaskReader::read(Task *t)
 {
-    QWriteLocker l(&lock);
-    waitForFinishedCondition.wait(&lock, msecs);
+    QByteArray source;
+    do {
+        if (!readEntry(&source))
+            return false;
+    } while (source.isEmpty());
+
+    *t = m_task;
+    t->source = QFile::decodeName(source);
+    if (m_options & QFileCopier::DestinationPairs) {
+        QByteArray dest;
+        if (!readEntry(&dest)) {
+            m_unpaired = true;
+            m_unpairedTask = *t;
+            return false;
+        }
+        QString destPath = QFile::decodeName(dest);
+        if (!m_task.dest.isEmpty() && QDir::isRelativePath(destPath))
+            destPath = QDir(m_task.dest).filePath(destPath);
+        t->dest = destPath;
+    }
+    return true;
 }
 
-void QFileCopierThread::emitProgress()
+/*!
+  \internal
+
+    Takes the source which was read without destination at the end of the list into \a t;
+    returns false if there is none.
+*/
+bool TaskReader::takeUnpaired(Task *t)
 {
-    shouldEmitProgress = true;
+    if (!m_unpaired)
+        return false;
+    m_unpaired = false;
+    *t = m_unpairedTask;
+    return true;
 }
 
-void QFileCopierThread::cancel()
+bool TaskReader::readEntry(QByteArray *entry)
 {
-    QWriteLocker l(&lock);
-    for (int id = 0; id < requests.size(); id++) {
-        requests[id].canceled = true;
-    }
-    cancelAllRequest = true;
+    char separator = (m_options & QFileCopier::NulSeparated) ? '\0' : '\n';
+    forever {
+        int end = m_buffer.indexOf(separator, m_position);
+        if (end != -1) {
+            *entry = m_buffer.mid(m_position, end - m_position);
+            m_position = end + 1;
+            return true;
+        }
 
-    if (waitingForInteraction)
-        interactionCondition.wakeOne();
+        if (m_atEnd) {
+            if (m_position == m_buffer.size())
+                return false;
+            *entry = m_buffer.mid(m_position); // last entry is not terminated
+            m_position = m_buffer.size();
+            return true;
+        }
+
+        m_buffer.remove(0, m_position);
+        m_position = 0;
+        QByteArray chunk = m_device->read(64*1024);
+        if (chunk.isEmpty())
+            m_atEnd = true;
+        else
+            m_buffer.append(chunk);
+    }
 }
 
-void QFileCopierThread::cancel(int id)
+bool FileFilter::isNull() const
 {
-    QWriteLocker l(&lock);
-    requests[id].canceled = true;
-
-    if (waitingForInteraction && m_currentId == id)
-        interactionCondition.wakeOne();
+    return includes.isEmpty() && excludes.isEmpty() && minSize <= 0 && maxSize < 0
+            && !modifiedAfter.isValid() && !modifiedBefore.isValid();
 }
 
-void QFileCopierThread::overwriteChildren(int id)
+bool FileFilter::isExcluded(const QString &name) const
 {
-    Request &r = requests[id];
-    r.overwrite = true;
-    for (int i = 0; i < r.childRequests.size(); i++) {
-        overwriteChildren(r.childRequests[i]);
+    foreach (const QRegExp &rx, excludes) {
+        if (rx.exactMatch(name))
+            return true;
     }
+    return false;
 }
 
-void QFileCopierThread::skip()
+bool FileFilter::isIncluded(const QFileInfo &info) const
 {
-    QWriteLocker l(&lock);
-    if (!waitingForInteraction)
-        return;
+    if (info.isDir())
+        return true;
 
-    requests[m_currentId].canceled = true;
-    waitingForInteraction = false;
-    interactionCondition.wakeOne();
-}
+    if (!includes.isEmpty()) {
+        bool matched = false;
+        foreach (const QRegExp &rx, includes) {
+            if (rx.exactMatch(info.fileName())) {
+                matched = true;
+                break;
+            }
+        }
+        if (!matched)
+            return false;
+    }
 
-void QFileCopierThread::skipAll()
-{
-    QWriteLocker l(&lock);
-    if (!waitingForInteraction)
-        return;
+    if (info.size() < minSize || (maxSize >= 0 && info.size() > maxSize))
+        return false;
 
-    int id = m_currentId;
-    requests[id].canceled = true;
-    skipAllRequest = true;
-    waitingForInteraction = false;
-    interactionCondition.wakeOne();
+    if (modifiedAfter.isValid() || modifiedBefore.isValid()) {
+        QDateTime modified = info.lastModified();
+        if ((modifiedAfter.isValid() && modified < modifiedAfter)
+                || (modifiedBefore.isValid() && !(modified < modifiedBefore))) {
+            return false;
+        }
+    }
+    return true;
 }
 
-void QFileCopierThread::overwrite()
+FileTimeEstimator::FileTimeEstimator()
 {
-    QWriteLocker l(&lock);
-    if (!waitingForInteraction)
-        return;
-
-    overwriteChildren(m_currentId);
-    waitingForInteraction = false;
-    interactionCondition.wakeOne();
+    for (int i = 0; i < SizeClassCount; i++) {
+        m_time[i] = 0;
+        m_size[i] = 0;
+        m_sampled[i] = false;
+    }
 }
 
-void QFileCopierThread::overwriteAll()
+int fileSizeClass(qint64 size)
 {
-    QWriteLocker l(&lock);
-    if (!waitingForInteraction)
-        return;
-
-    overwriteAllRequest = true;
-    waitingForInteraction = false;
-    interactionCondition.wakeOne();
+    int sizeClass = 0;
+    for (qint64 limit = Q_INT64_C(64*1024); size > limit && sizeClass < SizeClassCount - 1; limit *= 16)
+        sizeClass++;
+    return sizeClass;
 }
 
-void QFileCopierThread::rename()
+/*!
+  \internal
+
+    Adds \a time in nanoseconds it took to process file of \a size bytes to the exponentially
+    weighted average of its size class.
+*/
+void FileTimeEstimator::addFile(qint64 size, qint64 time)
 {
-    QWriteLocker l(&lock);
-    if (!waitingForInteraction)
-        return;
+    const double weight = 0.2;
 
-    requests[m_currentId].rename = true;
-    waitingForInteraction = false;
-    interactionCondition.wakeOne();
+    int i = fileSizeClass(size);
+    if (!m_sampled[i]) {
+        m_time[i] = time;
+        m_size[i] = size;
+        m_sampled[i] = true;
+    } else {
+        m_time[i] += weight * (time - m_time[i]);
+        m_size[i] += weight * (size - m_size[i]);
+    }
 }
 
-void QFileCopierThread::renameAll()
+/*!
+  \internal
+
+    Returns nanoseconds needed for \a files files of \a bytes bytes in total, or -1 if no file
+    was processed yet.
+
+    File time is modeled as per-file overhead plus size divided by throughput; overhead comes
+    from the smallest size class seen, throughput from the difference to the largest one.
+*/
+qint64 FileTimeEstimator::estimate(int files, qint64 bytes) const
 {
-    QWriteLocker l(&lock);
-    if (!waitingForInteraction)
-        return;
+    int smallest = -1;
+    int largest = -1;
+    for (int i = 0; i < SizeClassCount; i++) {
+        if (m_sampled[i]) {
+            if (smallest == -1)
+                smallest = i;
+            largest = i;
+        }
+    }
+    if (smallest == -1)
+        return -1;
 
-    renameAllRequest = true;
-    waitingForInteraction = false;
-    interactionCondition.wakeOne();
+    double perByte = 0;
+    double overhead = 0;
+    if (m_size[largest] > m_size[smallest] && m_time[largest] > m_time[smallest]) {
+        perByte = (m_time[largest] - m_time[smallest]) / (m_size[largest] - m_size[smallest]);
+        overhead = qMax(0.0, m_time[smallest] - m_size[smallest] * perByte);
+    } else if (m_size[largest] > 0) {
+        perByte = m_time[largest] / m_size[largest];
+    } else {
+        overhead = m_time[largest];
+    }
+
+    return qint64(qMax(0, files) * overhead + qMax(Q_INT64_C(0), bytes) * perByte);
 }
 
-void QFileCopierThread::retry()
+LatencyHistogram::LatencyHistogram()
 {
-    QWriteLocker l(&lock);
-    if (!waitingForInteraction)
-        return;
-
-    waitingForInteraction = false;
-    interactionCondition.wakeOne();
+    clear();
 }
 
-void QFileCopierThread::resetSkip()
+int LatencyHistogram::bucket(qint64 value)
 {
-    QWriteLocker l(&lock);
-    skipAllError.clear();
+    if (value < 2 * SubBucketCount)
+        return int(qMax(Q_INT64_C(0), value));
+
+    int highestBit = SubBucketBits + 1;
+    while (highestBit < 62 && (value >> (highestBit + 1)) != 0)
+        highestBit++;
+
+    int subBucket = int(value >> (highestBit - SubBucketBits)) & (SubBucketCount - 1);
+    return 2 * SubBucketCount + (highestBit - SubBucketBits - 1) * SubBucketCount + subBucket;
 }
 
-void QFileCopierThread::resetOverwrite()
+qint64 LatencyHistogram::bucketUpperBound(int bucket)
 {
-    // not sure this is correct
-    QWriteLocker l(&lock);
-    overwriteAllRequest = true;
+    if (bucket < 2 * SubBucketCount)
+        return bucket;
+
+    int highestBit = (bucket - 2 * SubBucketCount) / SubBucketCount + SubBucketBits + 1;
+    int subBucket = (bucket - 2 * SubBucketCount) % SubBucketCount;
+    int shift = highestBit - SubBucketBits;
+    qint64 lowerBound = (Q_INT64_C(1) << highestBit) | (qint64(subBucket) << shift);
+    return lowerBound + (Q_INT64_C(1) << shift) - 1;
 }
 
-void QFileCopierThread::merge()
+void LatencyHistogram::add(qint64 value)
 {
-    QWriteLocker l(&lock);
-    if (!waitingForInteraction)
-        return;
-
-    int requestId = m_currentId;
-    if (requests[requestId].isDir) {
-        requests[requestId].merge = true;
-        waitingForInteraction = false;
-        interactionCondition.wakeOne();
-    }
+    m_counts[bucket(value)]++;
+    m_count++;
+    m_max = qMax(m_max, value);
 }
 
-void QFileCopierThread::mergeAll()
+void LatencyHistogram::add(const LatencyHistogram &other)
 {
-    QWriteLocker l(&lock);
-    if (!waitingForInteraction)
-        return;
-
-    mergeAllRequest = true;
-    waitingForInteraction = false;
-    interactionCondition.wakeOne();
+    for (int i = 0; i < BucketCount; i++)
+        m_counts[i] += other.m_counts[i];
+    m_count += other.m_count;
+    m_max = qMax(m_max, other.m_max);
 }
 
-void QFileCopierThread::run()
+void LatencyHistogram::clear()
 {
-    bool stop = false;
+    for (int i = 0; i < BucketCount; i++)
+        m_counts[i] = 0;
+    m_count = 0;
+    m_max = 0;
+}
 
-    while (!stop) {
-        lock.lockForWrite();
+/*!
+  \internal
 
-        if (cancelAllRequest) {
-            cancelAllRequest = false;
-            taskQueue.clear();
-            requestQueue.clear();
-            topRequestsList.clear();
-            emit canceled();
-            lock.unlock();
-            continue;
-        }
+    Returns value below or at which \a percentile percents of values are, rounded up to the
+    bucket bound; 0 if histogram is empty.
+*/
+qint64 LatencyHistogram::percentile(qreal percentile) const
+{
+    if (m_count == 0)
+        return 0;
 
-        if (taskQueue.isEmpty()) {
-            if (requestQueue.isEmpty()) {
-                if (stopRequest) {
-                    lock.unlock();
-                    stop = true;
-                } else {
-                    setState(QFileCopier::Idle);
-                    emit done(hasError);
-                    hasError = false;
-                    waitForFinishedCondition.wakeOne();
-                    if (autoReset) {
-                        hasError = false;
-                        overwriteAllRequest = false;
-                        mergeAllRequest = false;
-                        skipAllRequest = false;
-                        skipAllError.clear();
-                        topRequestsList.clear();
-                    }
-                    newCopyCondition.wait(&lock);
-                    lock.unlock();
-                }
-            } else {
-                lock.unlock();
-                setState(QFileCopier::Copying);
-                int id = requestQueue.takeFirst(); // inner queue, no lock
-                handle(id);
-            }
-        } else {
-            setState(QFileCopier::Gathering);
-            Task t = taskQueue.takeFirst();
-            lock.unlock();
+    qint64 rank = qint64(qBound(qreal(0), percentile, qreal(100)) / 100 * m_count + 0.5);
+    rank = qBound(Q_INT64_C(1), rank, m_count);
 
-            createRequest(t);
-        }
+    qint64 seen = 0;
+    for (int i = 0; i < BucketCount; i++) {
+        seen += m_counts[i];
+        if (seen >= rank)
+            return qMin(bucketUpperBound(i), m_max);
     }
-    deleteLater();
+    return m_max;
 }
 
-void QFileCopierThread::restart()
+void SharedProgress::publish(const QFileCopier::ProgressSnapshot &s)
 {
-    QWriteLocker l(&lock);
-    if (!isRunning()) {
-        start();
-    }
-    newCopyCondition.wakeOne();
+    sequence.fetchAndAddOrdered(1);
+    snapshot = s;
+    sequence.fetchAndAddRelease(1);
 }
 
-void QFileCopierThread::createRequest(Task t)
-{
-    QFileInfo sourceInfo(t.source);
-
-    t.source = sourceInfo.absoluteFilePath();
-    t.source = QDir::cleanPath(t.source);
-
-    if (!t.dest.isEmpty()) {
-        QFileInfo destInfo(t.dest);
-        if (destInfo.exists() && destInfo.isDir()) {
-            if (!destInfo.exists())
-                QDir().mkpath(destInfo.absoluteFilePath());
-            t.dest = destInfo.absoluteFilePath() + "/" + sourceInfo.fileName();
-        } else {
-            t.dest = destInfo.absoluteFilePath();
-        }
-
-        t.dest = QDir::cleanPath(t.dest);
+/*!
+  \internal
 
-#ifdef Q_OS_WIN
-        if (t.type == Task::Link) {
-            if (!t.dest.endsWith(QLatin1String(".lnk")))
-                t.dest += QLatin1String(".lnk");
-        }
+    Keeps loads before it from being reordered with loads after it. QAtomicInt of Qt 4 reads
+    its value with a plain volatile load and has no acquire load; volatile loads of MSVC have
+    acquire semantics already.
+*/
+static inline void acquireFence()
+{
+#if defined(Q_CC_GNU)
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
 #endif
-    }
-
-    int index = addRequestToQueue(Request(t));
-    if (index != -1) {
-        requestQueue.append(index);
-        topRequestsList.append(index);
-    }
 }
 
-bool QFileCopierThread::shouldMerge(const Request &r)
+QFileCopier::ProgressSnapshot SharedProgress::read() const
 {
-    return r.merge || mergeAllRequest /*|| (r.copyFlags & QFileCopier::Merge)*/;
+    QFileCopier::ProgressSnapshot result;
+    int before = 0;
+    int after = 0;
+    do {
+        before = sequence;
+        acquireFence();
+        result = snapshot;
+        acquireFence();
+        after = sequence;
+    } while ((before & 1) || before != after);
+    return result;
 }
 
-bool QFileCopierThread::shouldOverwrite(const Request &r)
+/*!
+  \internal
+
+    Detaches from shared progress \a memory; readers keep their attachments, so the segment
+    is marked as released first.
+*/
+static void releaseSharedProgress(QSharedMemory *memory)
 {
-    return r.overwrite || overwriteAllRequest || (r.copyFlags & QFileCopier::Force);
+    if (!memory)
+        return;
+
+    static_cast<SharedProgress *>(memory->data())->released.fetchAndStoreRelease(1);
+    delete memory;
 }
 
-bool QFileCopierThread::shouldRename(const Request &r)
+QFileCopierThread::QFileCopierThread(QObject *parent) :
+    QThread(parent),
+    lock(QReadWriteLock::Recursive),
+    m_currentId(-1),
+    m_statisticsEnabled(false),
+    m_totalFiles(0),
+    m_finishedFiles(0),
+    sharedProgress(0),
+    m_state(QFileCopier::Idle),
+    shouldEmitProgress(false),
+    scheduleChanged(false),
+    waitingForInteraction(false),
+    stopRequest(false),
+    skipAllRequest(false),
+    cancelAllRequest(false),
+    hasError(true),
+    m_errorCount(0),
+    m_deduplicatedSize(0),
+    m_duplicateFiles(0),
+    m_totalProgress(0),
+    m_totalSize(0),
+    autoReset(true)
 {
-    return r.rename || renameAllRequest;
+    publishProgress();
 }
 
-bool QFileCopierThread::checkRequest(int id)
+QFileCopierThread::~QFileCopierThread()
 {
+    stopRequest = true;
+    cancel();
     lock.lockForWrite();
-    int parentId = m_currentId;
-    m_currentId = id;
+    newCopyCondition.wakeOne();
     lock.unlock();
+    wait();
+    releaseSharedProgress(sharedProgress);
+}
 
-    bool done = false;
-    QFileCopier::Error err;
-    while (!done) {
-        Request r = request(id);
-        QFileInfo sourceInfo(r.source);
-        QFileInfo destInfo(r.dest);
-        err = QFileCopier::NoError;
-
-        if (r.canceled) {
-            done = true;
-            err = QFileCopier::Canceled;
-        } else if (!sourceInfo.exists()) {
-            err = QFileCopier::SourceNotExists;
-        } else if (!shouldRename(r) && sourceInfo == destInfo) {
-            err = QFileCopier::DestinationAndSourceEqual;
-        } else if (!shouldRename(r) && !shouldOverwrite(r) && !shouldMerge(r) && destInfo.exists()) {
-            err = QFileCopier::DestinationExists;
-        } else {
-            done = true;
-        }
+/*!
+  \internal
 
-        done = interact(id, r, done, err);
-    }
+    Adds a job with current filter. Lock must be held for writing.
+*/
+int QFileCopierThread::createJob()
+{
+    int job = jobs.size();
+    jobs.append(Job());
+    jobs[job].token = new CancelToken;
+    jobs[job].firstRequest = requests.size();
+    if (!m_filter.isNull())
+        jobs[job].filter = QSharedPointer<FileFilter>(new FileFilter(m_filter));
+    return job;
+}
 
-    lock.lockForWrite();
-    m_currentId = parentId;
-    lock.unlock();
+/*!
+  \internal
 
-    return err == QFileCopier::NoError;
+    Adds a job of \a list of tasks. Ids of \a transient job and its requests are reused once
+    it is finished, see dropFinishedJobs().
+*/
+int QFileCopierThread::enqueueTaskList(QList<Task> list, bool transient)
+{
+    QWriteLocker l(&lock);
+    int job = createJob();
+    jobs[job].pending = list.size();
+    jobs[job].transient = transient;
+    if (transient)
+        requests.setCheckpoint(requests.size());
+    for (int i = 0; i < list.size(); i++) {
+        list[i].job = job;
+    }
+    jobs[job].gathering = list.size();
+    taskQueue.append(list);
+    scheduleChanged = true;
+    restart();
+    return job;
 }
 
-int QFileCopierThread::addRequestToQueue(Request request)
+/*!
+  \internal
+
+    Adds a job which tasks are read from a list by \a reader. Reader is pending until the end
+    of the list is reached, so the job is not finished before that.
+*/
+int QFileCopierThread::enqueueTaskReader(TaskReader *reader)
 {
-    int id = -1;
+    QWriteLocker l(&lock);
+    int job = createJob();
+    jobs[job].pending = 1;
+    jobs[job].gathering = 1;
+    jobs[job].reader = QSharedPointer<TaskReader>(reader);
+    reader->setJob(job);
+    readerJobs.append(job);
+    scheduleChanged = true;
+    restart();
+    return job;
+}
 
-    {
-        QWriteLocker l(&lock);
-        id = requests.size();
-        requests.append(request);
-    }
+/*!
+  \internal
 
-    if (!checkRequest(id))
+    Adds a job which compares files copied by \a job with their sources. It is started when
+    nothing else is left to do, so \a job is finished by then.
+*/
+int QFileCopierThread::enqueueVerification(int job)
+{
+    QWriteLocker l(&lock);
+    if (job < 0 || job >= jobs.size() || jobs.at(job).verifies != -1)
         return -1;
 
-    request = this->request(id); // refresh request
+    int verifyJob = createJob();
+    jobs[verifyJob].pending = 1;
+    jobs[verifyJob].verifies = job;
+    verifyJobs.enqueue(verifyJob);
+    restart();
+    return verifyJob;
+}
 
-    if (shouldRename(request)) {
+/*!
+  \internal
 
-        int i = 0;
-        QString dest = request.dest;
-        while (QFileInfo(dest).exists()) {
-            QFileInfo destInfo(request.dest);
+    Adds already gathered requests read from a manifest as a new job; parents and linked
+    requests in \a list are indexes in it.
+*/
+int QFileCopierThread::enqueueManifest(QList<Request> list, bool revalidate)
+{
+    QWriteLocker l(&lock);
+    int job = createJob();
+    Job &j = jobs[job];
+    j.revalidate = revalidate;
+    j.manifest = true;
+
+    int offset = requests.size();
+    QVector<QList<int> > children(list.size());
+    for (int i = 0; i < list.size(); i++) {
+        if (list.at(i).parent != -1)
+            children[list.at(i).parent].append(offset + i);
+    }
 
-#ifndef Q_CC_MSVC
-#warning "Uses mimetypes to determine type and extension"
-#endif
-            dest = destInfo.absolutePath() + QLatin1Char('/') + destInfo.completeBaseName() + QLatin1Char(' ') + QString::number(++i);
-            if (!destInfo.suffix().isEmpty()) {
-                dest += '.' + destInfo.suffix();
-            }
+    // whole manifest is stored before anything is queued, so it can be dropped as a whole
+    for (int i = 0; i < list.size(); i++) {
+        Request &r = list[i];
+        r.job = job;
+        r.childRequests = children.at(i);
+        if (r.parent != -1)
+            r.parent += offset;
+        if (r.linkTo != -1)
+            r.linkTo += offset;
+        if (!requests.append(r)) {
+            requests.truncate(offset);
+            storeFailed(-1, job);
+            emit jobFinished(job, true);
+            return -1;
         }
-        request.dest = dest;
-
     }
 
-    QFileInfo sourceInfo(request.source);
-    request.isDir = sourceInfo.isDir();
-    request.size = request.isDir ? 0 : sourceInfo.size();
-
-    {
-        QWriteLocker l(&lock);
+    for (int i = 0; i < list.size(); i++) {
+        const Request &r = list.at(i);
+        m_totalSize += r.size;
+        j.size += r.size;
+        if (!r.isDir)
+            m_totalFiles++;
+        // symbolic links are not known without stating them, they are just never hashed
+        if ((r.copyFlags & QFileCopier::Deduplicate) && r.linkTo == -1 && !r.isDir && r.size > 0
+                && (r.type == Task::Copy || (r.type == Task::Move && !r.sameDevice))) {
+            j.sizeCounts[r.size]++;
+        }
 
-        m_totalSize += request.size;
-        requests[id] = request; // update request
+        if (r.parent == -1) {
+            requestQueue.append(offset + i);
+            topRequestsList.append(offset + i);
+            j.topRequests.append(offset + i);
+        }
     }
 
-    if (request.isDir) {
-        if (request.type == Task::Move && !(request.copyFlags & QFileCopier::CopyOnMove)) {
-            return id;
-        }
-        if (request.type == Task::Link) {
-            return id;
-        }
+    j.pending = j.topRequests.size();
+    if (j.pending == 0)
+        emit jobFinished(job, false);
 
-        QList<int> childRequests;
+    scheduleChanged = true;
+    publishProgress();
+    restart();
+    return job;
+}
 
-        QDirIterator i(request.source, QDir::AllEntries | QDir::Hidden | QDir::NoDotAndDotDot);
-        while (i.hasNext()) {
-            QString source = i.next();
+/*!
+  \internal
 
-            Request r;
-            r.type = request.type;
-            r.source = source;
-            r.dest = request.dest + "/" + QFileInfo(source).fileName();
-            r.copyFlags = request.copyFlags;
+    Writes gathered requests of \a job to \a out in pre-order, so each parent precedes its
+    children; paths of children are stored relative to their parents where possible.
+    Returns false if the job does not exist or is still being gathered.
+*/
+bool QFileCopierThread::saveManifest(int job, QDataStream &out) const
+{
+    QReadLocker l(&lock);
+    if (job < 0 || job >= jobs.size() || jobs.at(job).gathering > 0)
+        return false;
 
-            int index = addRequestToQueue(r);
-            if (index != -1)
-                childRequests.append(index);
-        }
+    QList<int> ids;
+    QHash<int, int> indexes; // request id to index in manifest
+    QStack<int> stack;
+    const QList<int> &topRequests = jobs.at(job).topRequests;
+    if (!topRequests.isEmpty() && requests.at(topRequests.first()).type == Task::Archive)
+        return false; // path of the archive is not stored in requests
+    for (int i = topRequests.size() - 1; i >= 0; i--)
+        stack.push(topRequests.at(i));
+    while (!stack.isEmpty()) {
+        int id = stack.pop();
+        indexes.insert(id, ids.size());
+        ids.append(id);
+        QList<int> children = requests.childRequests(id);
+        for (int i = children.size() - 1; i >= 0; i--)
+            stack.push(children.at(i));
+    }
 
-        requests[id].childRequests = childRequests; // atomic assign
+    out << manifestMagic << manifestVersion;
+    out.setVersion(QDataStream::Qt_4_6);
+    out << qint32(ids.size());
+    foreach (int id, ids) {
+        Request r = requests.at(id);
+        int parent = indexes.value(r.parent, -1);
+        quint8 flags = (r.isDir ? ManifestIsDir : 0)
+                | (r.sameDevice ? ManifestSameDevice : 0)
+                | (r.overwrite ? ManifestOverwrite : 0)
+                | (r.merge ? ManifestMerge : 0);
+        QString source = r.source;
+        QString dest = r.dest;
+        if (parent != -1) {
+            QString name = QFileInfo(r.source).fileName();
+            if (r.source == requests.source(r.parent) + QLatin1Char('/') + name) {
+                source = name;
+                flags |= ManifestRelativeSource;
+                if (r.dest == requests.dest(r.parent) + QLatin1Char('/') + name) {
+                    dest.clear();
+                    flags |= ManifestRelativeDest;
+                }
+            }
+        }
+        out << quint8(r.type) << flags << qint32(r.copyFlags) << qint32(parent)
+            << qint32(indexes.value(r.linkTo, -1)) << r.size << source << dest;
     }
+    return out.status() == QDataStream::Ok;
+}
 
-    return id;
+QList<int> QFileCopierThread::pendingRequests(int id) const
+{
+    int size = 0;
+    {
+        QReadLocker l(&lock);
+        size = requests.size();
+    }
+    QList<int> result;
+    for ( ; id < size; id++) {
+        result.append(id);
+    }
+    return result;
 }
 
-bool QFileCopierThread::interact(int id, const Request &r, bool done, QFileCopier::Error err)
+QList<int> QFileCopierThread::topRequests() const
 {
-    if (done || (r.copyFlags & QFileCopier::NonInteractive)) {
-        done = true;
-        if (err != QFileCopier::NoError)
-            emit error(id, err, false);
-    } else {
-        lock.lockForWrite();
-        if (stopRequest || skipAllError.contains(err)) {
-            done = true;
-            if (!stopRequest)
-                emit error(id, err, false);
-        } else {
-            emit error(id, err, true);
-            waitingForInteraction = true;
-            interactionCondition.wait(&lock);
-            if (skipAllRequest) {
-                skipAllRequest = false;
-                skipAllError.insert(err);
-            }
-        }
-        lock.unlock();
-    }
-    return done;
+    QReadLocker l(&lock);
+    return topRequestsList;
+}
+
+QFileCopier::State QFileCopierThread::state() const
+{
+    return m_state;
+}
+
+void QFileCopierThread::setState(QFileCopier::State state)
+{
+    QWriteLocker l(&lock);
+
+    m_state = state;
+    publishProgress();
+    emit stateChanged(m_state);
+}
+
+Request QFileCopierThread::request(int id) const
+{
+    QReadLocker l(&lock);
+    return requests.value(id);
+}
+
+QString QFileCopierThread::sourceFilePath(int id) const
+{
+    QReadLocker l(&lock);
+    return id >= 0 && id < requests.size() ? requests.source(id) : QString();
+}
+
+QString QFileCopierThread::destinationFilePath(int id) const
+{
+    QReadLocker l(&lock);
+    return id >= 0 && id < requests.size() ? requests.dest(id) : QString();
+}
+
+bool QFileCopierThread::isDir(int id) const
+{
+    QReadLocker l(&lock);
+    return id >= 0 && id < requests.size() && requests.testFlag(id, RequestStore::IsDir);
+}
+
+QList<int> QFileCopierThread::entryList(int id) const
+{
+    QReadLocker l(&lock);
+    return id >= 0 && id < requests.size() ? requests.childRequests(id) : QList<int>();
+}
+
+qint64 QFileCopierThread::size(int id) const
+{
+    QReadLocker l(&lock);
+    return id >= 0 && id < requests.size() ? requests.entrySize(id) : 0;
+}
+
+int QFileCopierThread::priority(int id) const
+{
+    QReadLocker l(&lock);
+    return id >= 0 && id < requests.size() ? requests.priority(id) : 0;
+}
+
+int QFileCopierThread::jobId(int id) const
+{
+    QReadLocker l(&lock);
+    return id >= 0 && id < requests.size() ? requests.job(id) : -1;
+}
+
+Job QFileCopierThread::job(int id) const
+{
+    QReadLocker l(&lock);
+    return jobs.value(id);
+}
+
+void QFileCopierThread::setJobPriority(int job, int priority)
+{
+    QWriteLocker l(&lock);
+    if (job < 0 || job >= jobs.size())
+        return;
+
+    jobs[job].priority = priority;
+    scheduleChanged = true;
 }
 
 /*!
   \internal
 
-    Creates dir if necessary; throws error if fails
+    Changes priority of the request. Pending request with priority higher than priority of
+    request being processed preempts it at next entry or chunk.
+
+    Unstarted ancestors inherit priority, so the topmost of them is scheduled and the path
+    to request is created before anything else in it.
 */
-bool QFileCopierThread::createDir(const Request &r, QFileCopier::Error *err)
+void QFileCopierThread::setPriority(int id, int priority)
 {
-//        if (!shouldMerge(r) && !QDir().mkpath(r.dest)) {
-//            *err = QFileCopier::CannotCreateDestinationDirectory;
-//            return false;
-//        }
-//        if (shouldMerge(r) && !QFileInfo(r.dest).exists() && !QDir().mkpath(r.dest)) {
-//            *err = QFileCopier::CannotCreateDestinationDirectory;
-//            return false;
-//        }
+    QWriteLocker l(&lock);
+    if (id < 0 || id >= requests.size())
+        return;
 
-    if (!(shouldMerge(r) && QFileInfo(r.dest).exists())) {
-        if (!QDir().mkpath(r.dest)) {
-            *err = QFileCopier::CannotCreateDestinationDirectory;
-            return false;
-        }
+    requests.setPriority(id, priority);
+
+    int urgent = id;
+    while (requests.parent(urgent) != -1 && !requests.testFlag(requests.parent(urgent), RequestStore::Handled)) {
+        urgent = requests.parent(urgent);
+        if (requests.priority(urgent) < priority)
+            requests.setPriority(urgent, priority);
     }
 
-    return true;
+    if (!requests.testFlag(urgent, RequestStore::Handled) && !urgentRequests.contains(urgent))
+        urgentRequests.append(urgent);
+
+    scheduleChanged = true;
 }
 
-bool QFileCopierThread::copyFile(const Request &r, QFileCopier::Error *err)
+int QFileCopierThread::count() const
 {
-    QString source = r.source;
-    QFileInfo sourceInfo(source);
+    QReadLocker l(&lock);
+    return requests.size();
+}
 
-    if (sourceInfo.isSymLink()) {
-        source = sourceInfo.symLinkTarget();
-        if (!(r.copyFlags & QFileCopier::FollowLinks)) {
-            if (!QFile::link(source, r.dest)) {
-                *err = QFileCopier::CannotCreateSymLink;
-                return false;
-            }
-            return true;
-        }
-    }
+QString QFileCopierThread::scratchDirectory() const
+{
+    QReadLocker l(&lock);
+    return requests.path();
+}
 
-    QFile sourceFile(source);
-    if (!sourceFile.open(QFile::ReadOnly)) {
-        *err = QFileCopier::CannotOpenSourceFile;
-        return false;
-    }
+bool QFileCopierThread::setScratchDirectory(const QString &path)
+{
+    QWriteLocker l(&lock);
+    return requests.setPath(path);
+}
 
-    QFile destFile(r.dest);
-    bool result = destFile.open(QFile::WriteOnly);
-    if (!result) {
-        *err = QFileCopier::CannotOpenDestinationFile;
-        return false;
+FileFilter QFileCopierThread::filter() const
+{
+    QReadLocker l(&lock);
+    return m_filter;
+}
+
+void QFileCopierThread::setFilter(const FileFilter &filter)
+{
+    QWriteLocker l(&lock);
+    m_filter = filter;
+}
+
+qint64 QFileCopierThread::totalProgress() const
+{
+    QReadLocker l(&lock);
+    return m_totalProgress;
+}
+
+qint64 QFileCopierThread::totalSize() const
+{
+    QReadLocker l(&lock);
+    return m_totalSize;
+}
+
+qint64 QFileCopierThread::deduplicatedSize() const
+{
+    QReadLocker l(&lock);
+    return m_deduplicatedSize;
+}
+
+int QFileCopierThread::duplicateFiles() const
+{
+    QReadLocker l(&lock);
+    return m_duplicateFiles;
+}
+
+int QFileCopierThread::duplicateGroups() const
+{
+    QReadLocker l(&lock);
+    return duplicatedContents.size();
+}
+
+void QFileCopierThread::setStatisticsEnabled(bool on)
+{
+    m_statisticsEnabled = on;
+}
+
+void QFileCopierThread::resetStatistics()
+{
+    {
+        QWriteLocker l(&lock);
+        m_deduplicatedSize = 0;
+        m_duplicateFiles = 0;
+        duplicatedContents.clear();
     }
 
-    const int bufferSize = 4*1024; // 4 Kb
-    QScopedArrayPointer<char> buffer(new char[bufferSize]);
+    QMutexLocker l(&statisticsLock);
+    for (int phase = 0; phase < PhaseCount; phase++)
+        m_phaseStatistics[phase] = PhaseStatistics();
+    m_requestStatistics.clear();
+}
 
-    qint64 totalBytesWritten = 0;
-    qint64 totalFileSize = sourceFile.size();
-    qint64 prevTotalFileSize = totalFileSize;
-    qint64 totalProgress = 0;
+PhaseStatistics QFileCopierThread::phaseStatistics(QFileCopier::Phase phase) const
+{
+    QMutexLocker l(&statisticsLock);
+    return m_phaseStatistics[phase];
+}
 
-    qint64 lenRead = 0;
-    do {
+RequestStatistics QFileCopierThread::requestStatistics(int id) const
+{
+    QMutexLocker l(&statisticsLock);
+    return m_requestStatistics.value(id);
+}
 
-        if (r.canceled || cancelAllRequest) {
-            *err = QFileCopier::Canceled;
-            return true;
-        }
+void QFileCopierThread::addStatistics(int id, QFileCopier::Phase phase, qint64 time, qint64 bytes)
+{
+    PhaseStatistics call;
+    call.time = time;
+    call.bytes = bytes;
+    call.calls = 1;
+
+    QMutexLocker l(&statisticsLock);
+    m_phaseStatistics[phase].add(call);
+    if (id != -1)
+        m_requestStatistics[id].phases[phase].add(call);
+}
 
-        lenRead = sourceFile.read(buffer.data(), bufferSize);
-        if (lenRead != 0) {
+/*!
+  \internal
 
-            if (lenRead == -1) {
-                *err = QFileCopier::CannotReadSourceFile;
-                return false;
-            }
+    Returns histogram of \a latency for files of \a sizeClass, or of all files if it is -1.
+*/
+LatencyHistogram QFileCopierThread::latencyHistogram(QFileCopier::Latency latency, int sizeClass) const
+{
+    QMutexLocker l(&statisticsLock);
+    if (sizeClass != -1)
+        return m_latencies[latency][qBound(0, sizeClass, SizeClassCount - 1)];
+
+    LatencyHistogram histogram;
+    for (int i = 0; i < SizeClassCount; i++)
+        histogram.add(m_latencies[latency][i]);
+    return histogram;
+}
 
-            qint64 lenWritten = 0;
-            while (lenWritten < lenRead) {
-                qint64 tmpLenWritten = destFile.write(buffer.data() + lenWritten, lenRead - lenWritten);
-                if (tmpLenWritten == -1) {
-                    *err = QFileCopier::CannotWriteDestinationFile;
-                    return false;
-                }
-                lenWritten += tmpLenWritten;
-            }
+void QFileCopierThread::addLatency(QFileCopier::Latency latency, qint64 size, qint64 time)
+{
+    if (!m_statisticsEnabled)
+        return;
 
-            totalBytesWritten += lenWritten;
-            totalProgress += lenWritten;
-            if (totalFileSize < totalBytesWritten) {
-                totalFileSize = totalBytesWritten;
-            }
-        }
+    QMutexLocker l(&statisticsLock);
+    m_latencies[latency][fileSizeClass(size)].add(time);
+}
 
-        if (shouldEmitProgress || lenRead == 0) { // we need to emit signal at end of loop
-            {
-                QWriteLocker l(&lock);
-                requests[m_currentId].size = totalFileSize;
-                m_totalSize += totalFileSize - prevTotalFileSize;
-                m_totalProgress += totalProgress;
-                totalProgress = 0;
-                prevTotalFileSize = totalFileSize;
-            }
-            shouldEmitProgress = false;
-            emit progress(totalBytesWritten, totalFileSize);
-        }
+void QFileCopierThread::resetLatencies()
+{
+    QMutexLocker l(&statisticsLock);
+    for (int latency = 0; latency < LatencyCount; latency++) {
+        for (int i = 0; i < SizeClassCount; i++)
+            m_latencies[latency][i].clear();
+    }
+}
 
-    } while (lenRead != 0);
+/*!
+  \internal
+
+    Publishes progress also to shared memory segment with \a key; empty key stops it.
+*/
+bool QFileCopierThread::setSharedMemoryKey(const QString &key)
+{
+    QWriteLocker l(&lock);
+
+    releaseSharedProgress(sharedProgress);
+    sharedProgress = 0;
+    if (key.isEmpty())
+        return true;
+
+    // existing segment is published by someone else, or still read after it was released
+    QSharedMemory *memory = new QSharedMemory(key);
+    if (!memory->create(sizeof(SharedProgress))) {
+        delete memory;
+        return false;
+    }
 
+    new (memory->data()) SharedProgress;
+    sharedProgress = memory;
+    publishProgress();
     return true;
 }
 
-bool QFileCopierThread::copy(const Request &r, QFileCopier::Error *err)
+/*!
+  \internal
+
+    Publishes current values for lock-free readers; must be called with the lock held for
+    writing, so there is only one writer at a time.
+*/
+void QFileCopierThread::publishProgress()
 {
-    if (r.isDir) {
+    QFileCopier::ProgressSnapshot snapshot;
+    snapshot.state = m_state;
+    snapshot.currentId = m_currentId;
+    snapshot.currentJob = m_currentId != -1 ? requests.job(m_currentId) : -1;
+    snapshot.requests = requests.size();
+    snapshot.totalFiles = m_totalFiles;
+    snapshot.finishedFiles = m_finishedFiles;
+    snapshot.errors = m_errorCount;
+    snapshot.totalProgress = m_totalProgress;
+    snapshot.totalSize = m_totalSize;
+
+    m_progress.publish(snapshot);
+    if (sharedProgress)
+        static_cast<SharedProgress *>(sharedProgress->data())->publish(snapshot);
+}
 
-        if (!createDir(r, err))
-            return false;
+int QFileCopierThread::finishedFiles() const
+{
+    QReadLocker l(&lock);
+    return m_finishedFiles;
+}
 
-        foreach (int id, r.childRequests) {
-            handle(id);
-        }
+/*!
+  \internal
 
-    } else {
-        return copyFile(r, err);
-    }
+    Returns milliseconds needed for files not processed yet, or -1 if it cannot be estimated.
+*/
+qint64 QFileCopierThread::estimatedTimeRemaining() const
+{
+    QReadLocker l(&lock);
+    qint64 time = estimator.estimate(m_totalFiles - m_finishedFiles, m_totalSize - m_totalProgress);
+    return time == -1 ? -1 : time / 1000000;
+}
+
+void QFileCopierThread::setAutoReset(bool on)
+{
+    QWriteLocker l(&lock);
+    autoReset = on;
+}
+
+void QFileCopierThread::waitForFinished(unsigned long msecs)
+{
+    QWriteLocker l(&lock);
+    waitForFinishedCondition.wait(&lock, msecs);
+}
+
+void QFileCopierThread::emitProgress()
+{
+    shouldEmitProgress = true;
+}
+
+void QFileCopierThread::cancel()
+{
+    QWriteLocker l(&lock);
+    for (int job = 0; job < jobs.size(); job++) {
+        jobs[job].canceled = true;
+        jobs[job].token->cancel();
+    }
+    cancelAllRequest = true;
+
+    if (waitingForInteraction)
+        interactionCondition.wakeOne();
+}
+
+void QFileCopierThread::cancel(int id)
+{
+    QWriteLocker l(&lock);
+    cancelRequest(id);
+
+    if (waitingForInteraction && m_currentId == id)
+        interactionCondition.wakeOne();
+}
+
+void QFileCopierThread::cancelJob(int job)
+{
+    QWriteLocker l(&lock);
+    if (job < 0 || job >= jobs.size())
+        return;
+
+    jobs[job].canceled = true;
+    jobs[job].token->cancel();
+
+    if (waitingForInteraction && m_currentId != -1 && requests.job(m_currentId) == job)
+        interactionCondition.wakeOne();
+}
+
+void QFileCopierThread::overwriteChildren(int id)
+{
+    requests.setFlag(id, RequestStore::Overwrite);
+    foreach (int child, requests.childRequests(id)) {
+        overwriteChildren(child);
+    }
+}
+
+void QFileCopierThread::skip()
+{
+    QWriteLocker l(&lock);
+    if (!waitingForInteraction)
+        return;
+
+    cancelRequest(m_currentId);
+    waitingForInteraction = false;
+    interactionCondition.wakeOne();
+}
+
+void QFileCopierThread::skipAll()
+{
+    QWriteLocker l(&lock);
+    if (!waitingForInteraction)
+        return;
+
+    cancelRequest(m_currentId);
+    skipAllRequest = true; // remembered in the job of the request by interact()
+    waitingForInteraction = false;
+    interactionCondition.wakeOne();
+}
+
+void QFileCopierThread::overwrite()
+{
+    QWriteLocker l(&lock);
+    if (!waitingForInteraction)
+        return;
+
+    overwriteChildren(m_currentId);
+    waitingForInteraction = false;
+    interactionCondition.wakeOne();
+}
+
+void QFileCopierThread::overwriteAll()
+{
+    QWriteLocker l(&lock);
+    if (!waitingForInteraction)
+        return;
+
+    jobs[requests.job(m_currentId)].overwriteAll = true;
+    waitingForInteraction = false;
+    interactionCondition.wakeOne();
+}
+
+void QFileCopierThread::rename()
+{
+    QWriteLocker l(&lock);
+    if (!waitingForInteraction)
+        return;
+
+    requests.setFlag(m_currentId, RequestStore::Rename);
+    waitingForInteraction = false;
+    interactionCondition.wakeOne();
+}
+
+void QFileCopierThread::renameAll()
+{
+    QWriteLocker l(&lock);
+    if (!waitingForInteraction)
+        return;
+
+    jobs[requests.job(m_currentId)].renameAll = true;
+    waitingForInteraction = false;
+    interactionCondition.wakeOne();
+}
+
+void QFileCopierThread::retry()
+{
+    QWriteLocker l(&lock);
+    if (!waitingForInteraction)
+        return;
+
+    waitingForInteraction = false;
+    interactionCondition.wakeOne();
+}
+
+void QFileCopierThread::resetSkip()
+{
+    QWriteLocker l(&lock);
+    for (int job = 0; job < jobs.size(); job++) {
+        jobs[job].skipAllErrors.clear();
+    }
+}
+
+void QFileCopierThread::resetOverwrite()
+{
+    QWriteLocker l(&lock);
+    for (int job = 0; job < jobs.size(); job++) {
+        jobs[job].overwriteAll = false;
+    }
+}
+
+void QFileCopierThread::merge()
+{
+    QWriteLocker l(&lock);
+    if (!waitingForInteraction)
+        return;
+
+    if (requests.testFlag(m_currentId, RequestStore::IsDir)) {
+        requests.setFlag(m_currentId, RequestStore::Merge);
+        waitingForInteraction = false;
+        interactionCondition.wakeOne();
+    }
+}
+
+void QFileCopierThread::mergeAll()
+{
+    QWriteLocker l(&lock);
+    if (!waitingForInteraction)
+        return;
+
+    jobs[requests.job(m_currentId)].mergeAll = true;
+    waitingForInteraction = false;
+    interactionCondition.wakeOne();
+}
+
+void QFileCopierThread::run()
+{
+    bool stop = false;
+
+    while (!stop) {
+        TraceScope lockWait(&m_tracer, "lock", "wait for lock");
+        lock.lockForWrite();
+        lockWait.end();
+
+        if (cancelAllRequest) {
+            cancelAllRequest = false;
+            taskQueue.clear();
+            foreach (int job, readerJobs)
+                jobs[job].reader.clear();
+            readerJobs.clear();
+            verifyJobs.clear();
+            requestQueue.clear();
+            urgentRequests.clear();
+            topRequestsList.clear();
+            for (int job = 0; job < jobs.size(); job++) {
+                jobs[job].gathering = 0;
+                if (jobs[job].pending > 0) {
+                    jobs[job].pending = 0;
+                    jobs[job].canceled = true;
+                    closeArchive(job);
+                    jobs[job].clearLinkTables();
+                    emit jobFinished(job, true);
+                }
+            }
+            m_finishedFiles = m_totalFiles;
+            publishProgress();
+            emit canceled();
+            lock.unlock();
+            continue;
+        }
+
+        Task t;
+        int id = -1;
+        int readerJob = -1;
+        bool top = false;
+        if (takeNextTask(INT_MIN, &t)) {
+            setState(QFileCopier::Gathering);
+            lock.unlock();
+
+            createRequest(t);
+        } else if ((readerJob = takeNextReader(INT_MIN)) != -1) {
+            setState(QFileCopier::Gathering);
+            lock.unlock();
+
+            readTasks(readerJob);
+        } else if (takeUrgentRequest(INT_MIN, &id, &top)) {
+            lock.unlock();
+            setState(QFileCopier::Copying);
+            if (top)
+                handleTopRequest(id);
+            else
+                handle(id);
+        } else if (takeNextRequest(INT_MIN, &id)) {
+            lock.unlock();
+            setState(QFileCopier::Copying);
+            handleTopRequest(id);
+        } else if (!verifyJobs.isEmpty()) {
+            int job = verifyJobs.dequeue();
+            lock.unlock();
+            setState(QFileCopier::Copying);
+            verify(job);
+        } else if (stopRequest) {
+            lock.unlock();
+            stop = true;
+        } else {
+            setState(QFileCopier::Idle);
+            m_finishedFiles = m_totalFiles; // skipped and canceled entries are never handled
+            publishProgress();
+            emit done(hasError);
+            hasError = false;
+            waitForFinishedCondition.wakeOne();
+            if (autoReset) {
+                hasError = false;
+                skipAllRequest = false;
+                topRequestsList.clear();
+            }
+            newCopyCondition.wait(&lock);
+            lock.unlock();
+        }
+    }
+    deleteLater();
+}
+
+void QFileCopierThread::restart()
+{
+    QWriteLocker l(&lock);
+    if (!isRunning()) {
+        start();
+    }
+    newCopyCondition.wakeOne();
+}
+
+/*!
+  \internal
+
+    Takes the first task of the job with the highest priority not lower than \a minPriority.
+    Tasks of canceled jobs are dropped. Lock must be held for writing.
+*/
+bool QFileCopierThread::takeNextTask(int minPriority, Task *t)
+{
+    int index = -1;
+    int priority = minPriority;
+    for (int i = 0; i < taskQueue.size(); ) {
+        int job = taskQueue.at(i).job;
+        if (jobs.at(job).canceled) {
+            taskQueue.removeAt(i);
+            jobs[job].gathering--;
+            finishJob(job);
+            continue;
+        }
+        if (jobs.at(job).priority >= priority && (index == -1 || jobs.at(job).priority > priority)) {
+            index = i;
+            priority = jobs.at(job).priority;
+        }
+        i++;
+    }
+
+    if (index == -1)
+        return false;
+
+    *t = taskQueue.takeAt(index);
+    return true;
+}
+
+/*!
+  \internal
+
+    Returns the job with the highest priority not lower than \a minPriority which reads its
+    tasks from a list and has so few tasks and top requests pending that more should be read,
+    or -1. So the list is read while it is copied and only a batch of it is kept in memory.
+    Lists of canceled jobs are dropped. Lock must be held for writing.
+*/
+int QFileCopierThread::takeNextReader(int minPriority)
+{
+    int result = -1;
+    int priority = minPriority;
+    for (int i = 0; i < readerJobs.size(); ) {
+        int job = readerJobs.at(i);
+        const Job &j = jobs.at(job);
+        if (j.canceled) {
+            finishReader(job);
+            continue;
+        }
+        // reader itself is pending too
+        if (j.pending - 1 <= listBatchSize / 2 && j.priority >= priority && (result == -1 || j.priority > priority)) {
+            result = job;
+            priority = j.priority;
+        }
+        i++;
+    }
+    return result;
+}
+
+/*!
+  \internal
+
+    Reads next batch of tasks of the \a job from its list without holding the lock, so a slow
+    pipe does not block accessors.
+*/
+void QFileCopierThread::readTasks(int job)
+{
+    lock.lockForRead();
+    QSharedPointer<TaskReader> reader = jobs.at(job).reader;
+    int count = listBatchSize - (jobs.at(job).pending - 1);
+    lock.unlock();
+
+    if (!reader)
+        return;
+
+    QList<Task> list;
+    Task t;
+    bool atEnd = false;
+    while (list.size() < count && !atEnd) {
+        if (reader->read(&t))
+            list.append(t);
+        else
+            atEnd = true;
+    }
+
+    QWriteLocker l(&lock);
+    if (!jobs.at(job).reader) // canceled meanwhile
+        return;
+
+    jobs[job].pending += list.size();
+    jobs[job].gathering += list.size();
+    taskQueue.append(list);
+
+    // source is stored, so it can be told by its id, but it is never handled
+    if (atEnd && reader->takeUnpaired(&t)) {
+        Request r(t);
+        r.source = QDir::cleanPath(QFileInfo(t.source).absoluteFilePath());
+        r.dest.clear();
+        int id = requests.size();
+        if (!requests.append(r)) {
+            storeFailed(-1, job);
+        } else {
+            m_errorCount++;
+            jobs[job].hasError = true;
+            hasError = true;
+            publishProgress();
+            emit error(id, QFileCopier::MissingDestination, false);
+        }
+    }
+
+    if (atEnd)
+        finishReader(job);
+}
+
+/*!
+  \internal
+
+    Lock must be held for writing.
+*/
+void QFileCopierThread::finishReader(int job)
+{
+    jobs[job].reader.clear();
+    jobs[job].gathering--;
+    readerJobs.removeAll(job);
+    finishJob(job);
+}
+
+/*!
+  \internal
+
+    Same as takeNextTask() for gathered top requests.
+*/
+bool QFileCopierThread::takeNextRequest(int minPriority, int *id)
+{
+    int index = -1;
+    int priority = minPriority;
+    for (int i = 0; i < requestQueue.size(); ) {
+        int job = requests.job(requestQueue.at(i));
+        if (jobs.at(job).canceled) {
+            requestQueue.removeAt(i);
+            finishJob(job);
+            continue;
+        }
+        if (jobs.at(job).priority >= priority && (index == -1 || jobs.at(job).priority > priority)) {
+            index = i;
+            priority = jobs.at(job).priority;
+        }
+        i++;
+    }
+
+    if (index == -1)
+        return false;
+
+    *id = requestQueue.takeAt(index);
+    return true;
+}
+
+/*!
+  \internal
+
+    Takes request with highest priority not lower than \a minPriority from requests which
+    priority was raised by setPriority(). Requests already handled or canceled are dropped, and
+    so are children of directories that are not being handled anymore: such directory failed
+    or was canceled, so its children are never handled. Requests of jobs which write data of
+    an archive entry are kept until the entry is finished, since their headers would be
+    written into its data.
+
+    Top request still waiting in the request queue is taken from there too and \a top is
+    set, so the caller finishes its job as soon as it is handled.
+*/
+bool QFileCopierThread::takeUrgentRequest(int minPriority, int *id, bool *top)
+{
+    int index = -1;
+    int priority = minPriority;
+    for (int i = 0; i < urgentRequests.size(); ) {
+        int urgent = urgentRequests.at(i);
+        int parent = requests.parent(urgent);
+        CancelTokenPointer parentToken = tokens.value(parent);
+        if (requests.testFlag(urgent, RequestStore::Handled)
+                || requests.testFlag(urgent, RequestStore::Canceled)
+                || jobs.at(requests.job(urgent)).canceled
+                || (parent != -1 && (!parentToken || parentToken->isCanceled()))) {
+            urgentRequests.removeAt(i);
+            continue;
+        }
+        if (archiveEntryJobs.contains(requests.job(urgent))) {
+            i++;
+            continue;
+        }
+        int urgentPriority = requests.priority(urgent);
+        if (urgentPriority >= priority && (index == -1 || urgentPriority > priority)) {
+            index = i;
+            priority = urgentPriority;
+        }
+        i++;
+    }
+
+    if (index == -1)
+        return false;
+
+    *id = urgentRequests.takeAt(index);
+    *top = requests.parent(*id) == -1 && requestQueue.removeOne(*id);
+    return true;
+}
+
+/*!
+  \internal
+
+    Lock must be held for writing.
+*/
+void QFileCopierThread::finishJob(int job)
+{
+    Job &j = jobs[job];
+    if (--j.pending == 0) {
+        closeArchive(job);
+        j.clearLinkTables();
+        emit jobFinished(job, j.hasError || j.canceled);
+        if (j.transient)
+            dropFinishedJobs();
+    }
+}
+
+/*!
+  \internal
+
+    Drops finished transient jobs at the end of the job table together with their requests,
+    so a long running replication does not grow the tables; their ids are reused by next
+    jobs. A job is kept while anything is stored or handled after its requests, e.g. by a
+    job reading a list. Lock must be held for writing.
+*/
+void QFileCopierThread::dropFinishedJobs()
+{
+    while (!jobs.isEmpty()) {
+        int job = jobs.size() - 1;
+        const Job &j = jobs.at(job);
+        if (!j.transient || j.pending != 0 || m_currentId >= j.firstRequest)
+            return;
+        for (int id = j.firstRequest; id < requests.size(); id++) {
+            if (requests.job(id) != job || tokens.contains(id))
+                return;
+        }
+
+        int first = j.firstRequest;
+        for (int i = topRequestsList.size() - 1; i >= 0; i--) {
+            if (topRequestsList.at(i) >= first)
+                topRequestsList.removeAt(i);
+        }
+        for (int i = urgentRequests.size() - 1; i >= 0; i--) {
+            if (urgentRequests.at(i) >= first)
+                urgentRequests.removeAt(i);
+        }
+        foreach (int id, duplicatedContents) {
+            if (id >= first)
+                duplicatedContents.remove(id);
+        }
+        {
+            QMutexLocker statisticsLocker(&statisticsLock);
+            for (int id = first; id < requests.size(); id++)
+                m_requestStatistics.remove(id);
+        }
+        requests.truncate(first);
+        jobs.removeLast();
+    }
+}
+
+/*!
+  \internal
+
+    Completes archive written by the \a job; failure to complete it is an error of the job.
+    Lock must be held for writing.
+*/
+void QFileCopierThread::closeArchive(int job)
+{
+    Job &j = jobs[job];
+    if (!j.archive)
+        return;
+
+    if (!j.archive->close())
+        j.hasError = true;
+    j.archive.clear();
+}
+
+/*!
+  \internal
+
+    Marks request as canceled. Request that is being handled (and thus its whole subtree)
+    is canceled through its token, so there is no need to visit children.
+    Lock must be held for writing.
+*/
+void QFileCopierThread::cancelRequest(int id)
+{
+    requests.setFlag(id, RequestStore::Canceled);
+    CancelTokenPointer token = tokens.value(id);
+    if (token)
+        token->cancel();
+}
+
+/*!
+  \internal
+
+    Gathers and handles pending work of jobs with priority higher than priority of job of
+    request \a id, and pending requests with priority higher than priority of request \a id.
+*/
+void QFileCopierThread::preempt(int id)
+{
+    forever {
+        Task t;
+        int urgent = -1;
+        int readerJob = -1;
+        bool top = false;
+
+        lock.lockForWrite();
+        int jobPriority = jobs.at(requests.job(id)).priority;
+        int priority = requests.priority(id);
+
+        if (jobPriority < INT_MAX && takeNextTask(jobPriority + 1, &t)) {
+            setState(QFileCopier::Gathering);
+            lock.unlock();
+            createRequest(t);
+            setState(QFileCopier::Copying);
+        } else if (jobPriority < INT_MAX && (readerJob = takeNextReader(jobPriority + 1)) != -1) {
+            setState(QFileCopier::Gathering);
+            lock.unlock();
+            readTasks(readerJob);
+            setState(QFileCopier::Copying);
+        } else if (priority < INT_MAX && takeUrgentRequest(priority + 1, &urgent, &top)) {
+            lock.unlock();
+            if (top)
+                handleTopRequest(urgent);
+            else
+                handle(urgent);
+        } else if (jobPriority < INT_MAX && takeNextRequest(jobPriority + 1, &urgent)) {
+            lock.unlock();
+            handleTopRequest(urgent);
+        } else {
+            lock.unlock();
+            break;
+        }
+    }
+}
+
+/*!
+  \internal
+
+    Called between entries and chunks; cheap unless priorities or queues were changed.
+*/
+void QFileCopierThread::reschedule()
+{
+    if (!scheduleChanged)
+        return;
+
+    scheduleChanged = false;
+    preempt(m_currentId);
+}
+
+bool QFileCopierThread::isCanceled(const Request &r) const
+{
+    QReadLocker l(&lock);
+    return r.canceled || jobs.at(r.job).canceled;
+}
+
+void QFileCopierThread::createRequest(Task t)
+{
+    QFileInfo sourceInfo(t.source);
+
+    t.source = sourceInfo.absoluteFilePath();
+    t.source = QDir::cleanPath(t.source);
+
+    if (t.type == Task::Archive) {
+        QWriteLocker l(&lock);
+        if (!jobs.at(t.job).archive)
+            jobs[t.job].archive = QSharedPointer<QTarWriter>(new QTarWriter(QFileInfo(t.dest).absoluteFilePath()));
+        t.dest = sourceInfo.fileName(); // entries are stored relative to the archive root
+    } else if (!t.dest.isEmpty()) {
+        QFileInfo destInfo(t.dest);
+        // mirrored destination is replaced by the source, not a directory to put it in
+        if (destInfo.exists() && destInfo.isDir() && !(t.copyFlags & QFileCopier::Mirror)) {
+            if (!destInfo.exists())
+                QDir().mkpath(destInfo.absoluteFilePath());
+            t.dest = destInfo.absoluteFilePath() + "/" + sourceInfo.fileName();
+        } else {
+            t.dest = destInfo.absoluteFilePath();
+        }
+
+        t.dest = QDir::cleanPath(t.dest);
+
+#ifdef Q_OS_WIN
+        if (t.type == Task::Link) {
+            if (!t.dest.endsWith(QLatin1String(".lnk")))
+                t.dest += QLatin1String(".lnk");
+        }
+#endif
+    }
+
+    // subtree is gathered recursively, so only top requests are measured
+    PhaseTimer timer(this, -1, QFileCopier::GatheringPhase);
+    TraceScope gathering(&m_tracer, "gather", "gather");
+    Request request(t);
+    int index = addRequestToQueue(request);
+    timer.setId(index);
+    gathering.setId(index);
+    gathering.end();
+
+    QWriteLocker l(&lock);
+    jobs[t.job].gathering--;
+    if (index != -1) {
+        requestQueue.append(index);
+        topRequestsList.append(index);
+        jobs[t.job].topRequests.append(index);
+    } else {
+        finishJob(t.job);
+    }
+}
+
+bool QFileCopierThread::shouldMerge(const Request &r)
+{
+    QReadLocker l(&lock);
+    return r.merge || jobs.at(r.job).mergeAll || (r.copyFlags & QFileCopier::Mirror) /*|| (r.copyFlags & QFileCopier::Merge)*/;
+}
+
+bool QFileCopierThread::shouldOverwrite(const Request &r)
+{
+    QReadLocker l(&lock);
+    return r.overwrite || jobs.at(r.job).overwriteAll || (r.copyFlags & QFileCopier::Force)
+            || ((r.copyFlags & QFileCopier::Mirror) && !r.isDir);
+}
+
+bool QFileCopierThread::shouldRename(const Request &r)
+{
+    QReadLocker l(&lock);
+    return r.rename || jobs.at(r.job).renameAll;
+}
+
+/*!
+  \internal
+
+    Updates flags of \a r which user could change while request \a id waited for interaction,
+    so the request is not fetched again for each attempt.
+*/
+void QFileCopierThread::refreshFlags(int id, Request *r) const
+{
+    QReadLocker l(&lock);
+    r->canceled = requests.testFlag(id, RequestStore::Canceled);
+    r->rename = requests.testFlag(id, RequestStore::Rename);
+    r->overwrite = requests.testFlag(id, RequestStore::Overwrite);
+    r->merge = requests.testFlag(id, RequestStore::Merge);
+}
+
+/*!
+  \internal
+
+    Checks that source of request \a id loaded from a manifest still exists and has the same
+    type, and updates size of the file; destination is checked by recheckRequest().
+*/
+bool QFileCopierThread::revalidate(int id, Request *r, QFileCopier::Error *err)
+{
+    QFileInfo sourceInfo(r->source);
+    if ((!sourceInfo.exists() && !sourceInfo.isSymLink()) || sourceInfo.isDir() != r->isDir) {
+        *err = QFileCopier::SourceNotExists;
+        return false;
+    }
+
+    // hard links are counted in entries, linked copies were counted once
+    if (r->isDir || r->type == Task::HardLink || r->linkTo != -1 || sourceInfo.size() == r->size)
+        return true;
+
+    QWriteLocker l(&lock);
+    qint64 delta = sourceInfo.size() - r->size;
+    r->size = sourceInfo.size();
+    requests.setEntrySize(id, r->size);
+    m_totalSize += delta;
+    jobs[r->job].size += delta;
+    publishProgress();
+    return true;
+}
+
+/*!
+  \internal
+
+    Checks request \a id loaded from a manifest as it was checked when it was gathered, since
+    its destination could appear meanwhile. Answers saved with the manifest, such as
+    overwriting, still apply. Renamed destination is renamed for the whole subtree.
+*/
+bool QFileCopierThread::recheckRequest(int id, Request *r)
+{
+    if (!checkRequest(id, r))
+        return false;
+
+    if (r->type == Task::Archive || !shouldRename(*r))
+        return true;
+
+    QString dest = renamedPath(r->dest);
+    if (dest == r->dest)
+        return true;
+
+    bool result = rebaseDestinations(id, r->dest, dest);
+    r->dest = dest;
+    return result;
+}
+
+/*!
+  \internal
+
+    Replaces prefix \a from of destinations of request \a id and its subtree with \a to.
+    Entries which cannot be stored are canceled, so they are not handled at a wrong
+    destination, and reported; returns false if request \a id itself cannot be stored.
+*/
+bool QFileCopierThread::rebaseDestinations(int id, const QString &from, const QString &to)
+{
+    QWriteLocker l(&lock);
+    bool result = true;
+    QStack<int> stack;
+    stack.push(id);
+    while (!stack.isEmpty()) {
+        int entry = stack.pop();
+        Request e = requests.at(entry);
+        e.dest = to + e.dest.mid(from.size());
+        if (!requests.replace(entry, e)) {
+            requests.setFlag(entry, RequestStore::Canceled);
+            storeFailed(entry, e.job);
+            result = result && entry != id;
+        }
+        foreach (int child, e.childRequests)
+            stack.push(child);
+    }
+    return result;
+}
+
+bool QFileCopierThread::checkRequest(int id, Request *request)
+{
+    lock.lockForWrite();
+    int parentId = m_currentId;
+    m_currentId = id;
+    lock.unlock();
+
+    const Request &r = *request;
+    bool done = false;
+    QFileCopier::Error err;
+    while (!done) {
+        // destinations of archived entries are paths in the archive, not in file system
+        bool archived = r.type == Task::Archive;
+        QFileInfo sourceInfo(r.source);
+        QFileInfo destInfo(archived ? QString() : r.dest);
+        bool sourceExists = false;
+        bool destExists = false;
+        {
+            PhaseTimer timer(this, id, QFileCopier::StatPhase);
+            QElapsedTimer latency;
+            latency.start();
+            sourceExists = sourceInfo.exists();
+            destExists = !archived && destInfo.exists();
+            addLatency(QFileCopier::StatLatency, sourceExists ? sourceInfo.size() : 0, latency.nsecsElapsed());
+        }
+        err = QFileCopier::NoError;
+
+        if (isCanceled(r)) {
+            done = true;
+            err = QFileCopier::Canceled;
+        } else if (!sourceExists) {
+            err = QFileCopier::SourceNotExists;
+        } else if (!archived && !shouldRename(r) && sourceInfo == destInfo) {
+            err = QFileCopier::DestinationAndSourceEqual;
+        } else if (!shouldRename(r) && !shouldOverwrite(r) && !shouldMerge(r) && destExists) {
+            err = QFileCopier::DestinationExists;
+        } else {
+            done = true;
+        }
+
+        done = interact(id, r, done, err);
+        refreshFlags(id, request);
+    }
+
+    lock.lockForWrite();
+    m_currentId = parentId;
+    lock.unlock();
+
+    return err == QFileCopier::NoError;
+}
+
+/*!
+  \internal
+
+    Gathers \a request and its subtree. \a destDevice is device of directory where destination
+    is placed, if it is already known from the parent.
+*/
+int QFileCopierThread::addRequestToQueue(Request &request, const quint64 *destDevice)
+{
+    int id = -1;
+
+    {
+        QWriteLocker l(&lock);
+        id = requests.size();
+        if (!requests.append(request)) {
+            storeFailed(request.parent, request.job);
+            return -1;
+        }
+    }
+
+    if (!checkRequest(id, &request))
+        return -1;
+
+    if (request.type != Task::Archive && shouldRename(request))
+        request.dest = renamedPath(request.dest);
+
+    QFileInfo sourceInfo(request.source);
+    request.isDir = sourceInfo.isDir();
+    if (request.type == Task::HardLink)
+        request.size = 1; // no data is copied, progress is counted in entries
+    else
+        request.size = request.isDir ? 0 : sourceInfo.size();
+
+    // each entry is checked separately, so subtrees on destination device are renamed as a whole
+    bool checkDevice = request.type == Task::Move && !(request.copyFlags & QFileCopier::CopyOnMove);
+    if (checkDevice) {
+        quint64 device = destDevice ? *destDevice : 0;
+        request.sameDevice = (destDevice || directoryDevice(QFileInfo(request.dest).absolutePath(), &device))
+                && isSameDevice(request.source, device);
+    }
+
+    // later paths of the same inode are linked to the first copy, their data is counted once
+    if ((request.copyFlags & QFileCopier::PreserveHardLinks) && !request.isDir
+            && (request.type == Task::Copy || (request.type == Task::Move && !request.sameDevice))) {
+        FileId fileId;
+        if (hardLinkedFileId(request.source, &fileId)) {
+            QWriteLocker l(&lock);
+            QHash<FileId, int> &hardLinks = jobs[request.job].hardLinks;
+            int first = hardLinks.value(fileId, -1);
+            if (first == -1) {
+                hardLinks.insert(fileId, id);
+            } else {
+                request.linkTo = first;
+                request.size = 0;
+            }
+        }
+    }
+
+    bool countSize = (request.copyFlags & QFileCopier::Deduplicate) && request.linkTo == -1 && !request.isDir
+            && request.size > 0 && !sourceInfo.isSymLink()
+            && (request.type == Task::Copy || (request.type == Task::Move && !request.sameDevice));
+
+    {
+        QWriteLocker l(&lock);
+        if (!requests.replace(id, request)) { // update request
+            storeFailed(id, request.job);
+            return -1;
+        }
+
+        m_totalSize += request.size;
+        if (!request.isDir)
+            m_totalFiles++;
+        jobs[request.job].size += request.size;
+        if (countSize)
+            jobs[request.job].sizeCounts[request.size]++;
+        publishProgress();
+    }
+
+    if (request.isDir) {
+        if (request.type == Task::Move && request.sameDevice) {
+            return id;
+        }
+        if (request.type == Task::Link) {
+            return id;
+        }
+        if (request.type == Task::Remove && !(request.copyFlags & QFileCopier::FollowLinks)) {
+            return id; // removed as a whole by QFileRemover
+        }
+
+        QList<int> childRequests;
+
+        // all children are placed into the same directory, so its device is looked up once
+        quint64 childDestDevice = 0;
+        bool childDestDeviceKnown = checkDevice && directoryDevice(request.dest, &childDestDevice);
+
+        // moved and removed directories are renamed or removed as a whole, so they are not
+        // filtered: excluded entries would be removed anyway or left in the source
+        QSharedPointer<FileFilter> filter;
+        if (request.type != Task::Move && request.type != Task::Remove) {
+            lock.lockForRead();
+            filter = jobs.at(request.job).filter;
+            lock.unlock();
+        }
+
+        // mirrored directory is diffed with destination listed once, instead of checking
+        // destination of each entry separately
+        bool mirror = request.type == Task::Copy && (request.copyFlags & QFileCopier::Mirror);
+        QHash<QString, QFileInfo> destEntries;
+        QStringList staleEntries;
+        if (mirror) {
+            QDir destDir(request.dest);
+            foreach (const QFileInfo &info, destDir.entryInfoList(QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot))
+                destEntries.insert(info.fileName(), info);
+        }
+
+        QDirIterator i(request.source, QDir::AllEntries | QDir::Hidden | QDir::NoDotAndDotDot);
+        while (i.hasNext()) {
+            QString source = i.next();
+            QFileInfo destInfo = destEntries.take(i.fileName()); // filtered entries are kept too
+            // excluded names are checked first, so pruned subtrees are never stated
+            if (filter && (filter->isExcluded(i.fileName()) || !filter->isIncluded(i.fileInfo())))
+                continue;
+
+            if (mirror && !destInfo.fileName().isEmpty()) {
+                if (isUpToDate(i.fileInfo(), destInfo))
+                    continue;
+                // other entries are overwritten, but directory can't be merged into them
+                if (i.fileInfo().isDir() && (!destInfo.isDir() || destInfo.isSymLink()))
+                    staleEntries.append(destInfo.absoluteFilePath());
+            }
+
+            Request r;
+            r.type = request.type;
+            r.source = source;
+            r.dest = request.dest + "/" + QFileInfo(source).fileName();
+            r.copyFlags = request.copyFlags;
+            r.job = request.job;
+            r.parent = id;
+
+            int index = addRequestToQueue(r, childDestDeviceKnown ? &childDestDevice : 0);
+            if (index != -1)
+                childRequests.append(index);
+        }
+
+        // like rsync --delete, excluded entries are kept in stale directories too
+        foreach (const QFileInfo &info, destEntries) {
+            if (!filter || filter->excludes.isEmpty())
+                staleEntries.append(info.absoluteFilePath());
+            else if (!filter->isExcluded(info.fileName()))
+                addStaleEntry(info.absoluteFilePath(), *filter, &staleEntries);
+        }
+
+        // stale entries are removed before copying, directories in background in parallel
+        QList<int> removeRequests;
+        foreach (const QString &path, staleEntries) {
+            Request r;
+            r.type = Task::Remove;
+            r.source = path;
+            r.copyFlags = (request.copyFlags & ~(QFileCopier::Mirror | QFileCopier::FollowLinks)) | QFileCopier::RemoveInBackground;
+            r.job = request.job;
+            r.parent = id;
+
+            int index = addRequestToQueue(r);
+            if (index != -1)
+                removeRequests.append(index);
+        }
+        childRequests = removeRequests + childRequests;
+
+        QWriteLocker l(&lock);
+        if (!requests.setChildRequests(id, childRequests))
+            storeFailed(id, request.job);
+    }
+
+    return id;
+}
+
+/*!
+  \internal
+
+    Reports that request store cannot grow, e.g. because disk with scratch directory is full.
+    \a id is the request which was not stored completely, or parent of the one which was not
+    stored at all; its gathering fails. Lock must be held for writing.
+*/
+void QFileCopierThread::storeFailed(int id, int job)
+{
+    m_errorCount++;
+    jobs[job].hasError = true;
+    hasError = true;
+    publishProgress();
+    emit error(id, QFileCopier::CannotStoreRequest, false);
+}
+
+bool QFileCopierThread::interact(int id, const Request &r, bool done, QFileCopier::Error err)
+{
+    if (err != QFileCopier::NoError) {
+        QWriteLocker l(&lock);
+        m_errorCount++;
+        publishProgress();
+    }
+
+    if (done || (r.copyFlags & QFileCopier::NonInteractive)) {
+        done = true;
+        if (err != QFileCopier::NoError)
+            emit error(id, err, false);
+    } else {
+        lock.lockForWrite();
+        if (stopRequest || jobs.at(r.job).skipAllErrors.contains(err)) {
+            done = true;
+            if (!stopRequest)
+                emit error(id, err, false);
+        } else {
+            emit error(id, err, true);
+            waitingForInteraction = true;
+            TraceScope waiting(&m_tracer, "interaction", "wait for user", id);
+            interactionCondition.wait(&lock);
+            waiting.end();
+            if (skipAllRequest) {
+                skipAllRequest = false;
+                jobs[r.job].skipAllErrors.insert(err);
+            }
+        }
+        lock.unlock();
+    }
+    return done;
+}
+
+/*!
+  \internal
+
+    Creates dir if necessary; throws error if fails
+*/
+bool QFileCopierThread::createDir(const Request &r, QFileCopier::Error *err)
+{
+//        if (!shouldMerge(r) && !QDir().mkpath(r.dest)) {
+//            *err = QFileCopier::CannotCreateDestinationDirectory;
+//            return false;
+//        }
+//        if (shouldMerge(r) && !QFileInfo(r.dest).exists() && !QDir().mkpath(r.dest)) {
+//            *err = QFileCopier::CannotCreateDestinationDirectory;
+//            return false;
+//        }
+
+    if (!(shouldMerge(r) && QFileInfo(r.dest).exists())) {
+        if (!QDir().mkpath(r.dest)) {
+            *err = QFileCopier::CannotCreateDestinationDirectory;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+  \internal
+
+    Hard links destination of the first path of the same file instead of copying if
+    PreserveHardLinks is set.
+
+    With AtomicOverwrite, existing destination file is replaced only when the copy is complete:
+    data is written to a hidden file next to the destination which is then renamed over it.
+    Hard links and clones cannot be created over an existing file either, so they are made
+    aside and renamed the same way.
+*/
+bool QFileCopierThread::copyFile(const Request &r, QFileCopier::Error *err)
+{
+    QFileInfo destInfo(r.dest);
+    bool replace = (r.copyFlags & QFileCopier::AtomicOverwrite)
+            && (destInfo.exists() || destInfo.isSymLink()) && !destInfo.isDir();
+    QString path = replace ? QFileRemover::hiddenPath(r.dest, QLatin1String("part")) : r.dest;
+
+    // if first path was not copied (yet), data is copied instead
+    if (r.linkTo != -1 && createHardLink(destinationFilePath(r.linkTo), path)) {
+        if (!replace || replaceFile(path, r.dest))
+            return true;
+        QFile::remove(path);
+    }
+
+    // files of unique size are never hashed; first file of a size is hashed while it is copied
+    bool deduplicate = false;
+    bool sizeCopied = false;
+    if (r.copyFlags & QFileCopier::Deduplicate) {
+        QReadLocker l(&lock);
+        deduplicate = jobs.at(r.job).sizeCounts.value(r.size) > 1;
+        sizeCopied = jobs.at(r.job).copiedSizes.contains(r.size);
+    }
+    deduplicate = deduplicate && !QFileInfo(r.source).isSymLink();
+    QByteArray contentHash;
+    if (deduplicate && sizeCopied && linkDuplicate(r, path, &contentHash))
+        return true;
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    QCryptographicHash *copyHash = deduplicate && contentHash.isEmpty() ? &hash : 0;
+
+    bool result = copyFile(r, path, copyHash, err);
+    if (replace) {
+        if (result && *err == QFileCopier::NoError && !replaceFile(path, r.dest)) {
+            *err = QFileCopier::CannotRemoveDestinationFile;
+            result = false;
+        }
+        if (!result || *err != QFileCopier::NoError)
+            QFile::remove(path);
+    }
+
+    if (deduplicate && result && *err == QFileCopier::NoError) {
+        QWriteLocker l(&lock);
+        jobs[r.job].contents.insert(copyHash ? hash.result() : contentHash, m_currentId);
+        jobs[r.job].copiedSizes.insert(r.size);
+    }
+
+    return result;
+}
+
+bool QFileCopierThread::hashFile(const QString &path, QByteArray *result)
+{
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly))
+        return false;
+
+    PooledBuffer buffer;
+    if (!buffer.data())
+        return false;
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+
+    qint64 lenRead = 0;
+    while ((lenRead = file.read(buffer.data(), buffer.size())) > 0) {
+        if (cancelAllRequest || m_currentToken->isCanceled())
+            return false;
+        hash.addData(buffer.data(), int(lenRead));
+    }
+    if (lenRead == -1)
+        return false;
+
+    *result = hash.result();
+    return true;
+}
+
+/*!
+  \internal
+
+    Hashes source and, if a file with the same contents was already copied, clones or hard
+    links it to \a path, which is renamed over the destination if it differs.
+*/
+bool QFileCopierThread::linkDuplicate(const Request &r, const QString &path, QByteArray *contentHash)
+{
+    if (!hashFile(r.source, contentHash))
+        return false;
+
+    int first = -1;
+    {
+        QReadLocker l(&lock);
+        first = jobs.at(r.job).contents.value(*contentHash, -1);
+    }
+    if (first == -1)
+        return false;
+
+    QString firstDest = destinationFilePath(first);
+    if (!cloneFile(firstDest, path) && !createHardLink(firstDest, path))
+        return false;
+    if (path != r.dest && !replaceFile(path, r.dest)) {
+        QFile::remove(path);
+        return false;
+    }
+
+    {
+        QWriteLocker l(&lock);
+        m_totalProgress += r.size;
+        jobs[r.job].progress += r.size;
+        m_deduplicatedSize += r.size;
+        m_duplicateFiles++;
+        duplicatedContents.insert(first);
+        publishProgress();
+    }
+    emit progress(r.size, r.size);
+
+    return true;
+}
+
+bool QFileCopierThread::copyFile(const Request &r, const QString &dest, QCryptographicHash *hash, QFileCopier::Error *err)
+{
+    QString source = r.source;
+    QFileInfo sourceInfo(source);
+
+    if (sourceInfo.isSymLink()) {
+        source = sourceInfo.symLinkTarget();
+        if (!(r.copyFlags & QFileCopier::FollowLinks)) {
+            if (!QFile::link(source, dest)) {
+                *err = QFileCopier::CannotCreateSymLink;
+                return false;
+            }
+            return true;
+        }
+    }
+
+    QFile sourceFile(source);
+    QFile destFile(dest);
+    QElapsedTimer openLatency;
+    openLatency.start();
+    {
+        PhaseTimer timer(this, m_currentId, QFileCopier::OpenPhase);
+        if (!sourceFile.open(QFile::ReadOnly)) {
+            *err = QFileCopier::CannotOpenSourceFile;
+            return false;
+        }
+    }
+    {
+        PhaseTimer timer(this, m_currentId, QFileCopier::OpenPhase);
+        if (!destFile.open(QFile::WriteOnly)) {
+            *err = QFileCopier::CannotOpenDestinationFile;
+            return false;
+        }
+    }
+    addLatency(QFileCopier::OpenLatency, r.size, openLatency.nsecsElapsed());
+
+    bool result = copyData(r, &sourceFile, &destFile, -1, hash, err);
+    if (!result || *err == QFileCopier::Canceled)
+        return result;
+
+    PhaseTimer timer(this, m_currentId, QFileCopier::ClosePhase);
+    sourceFile.close();
+    destFile.close();
+
+    return true;
+}
+
+/*!
+  \internal
+
+    Copies data of \a sourceFile to \a destFile, but not more than \a maxSize bytes if it is
+    not negative, updating progress and size of current request.
+*/
+bool QFileCopierThread::copyData(const Request &r, QFile *sourceFile, QIODevice *destFile, qint64 maxSize,
+                                 QCryptographicHash *hash, QFileCopier::Error *err)
+{
+    PooledBuffer buffer;
+    if (!buffer.data()) {
+        *err = QFileCopier::CannotAllocateBuffer;
+        return false;
+    }
+
+    qint64 totalBytesWritten = 0;
+    qint64 totalFileSize = sourceFile->size();
+    qint64 prevTotalFileSize = totalFileSize;
+    qint64 totalProgress = 0;
+
+    qint64 lenRead = 0;
+    do {
+
+        reschedule();
+
+        if (cancelAllRequest || m_currentToken->isCanceled()) {
+            *err = QFileCopier::Canceled;
+            return true;
+        }
+
+        qint64 toRead = maxSize < 0 ? buffer.size() : qMin(qint64(buffer.size()), maxSize - totalBytesWritten);
+        {
+            PhaseTimer timer(this, m_currentId, QFileCopier::ReadPhase);
+            TraceScope trace(&m_tracer, "io", "read", m_currentId);
+            lenRead = toRead > 0 ? sourceFile->read(buffer.data(), toRead) : 0;
+            timer.setBytes(qMax(lenRead, qint64(0)));
+            trace.setBytes(qMax(lenRead, qint64(0)));
+        }
+        if (lenRead != 0) {
+
+            if (lenRead == -1) {
+                *err = QFileCopier::CannotReadSourceFile;
+                return false;
+            }
+
+            qint64 lenWritten = 0;
+            while (lenWritten < lenRead) {
+                PhaseTimer timer(this, m_currentId, QFileCopier::WritePhase);
+                TraceScope trace(&m_tracer, "io", "write", m_currentId);
+                qint64 tmpLenWritten = destFile->write(buffer.data() + lenWritten, lenRead - lenWritten);
+                timer.setBytes(qMax(tmpLenWritten, qint64(0)));
+                trace.setBytes(qMax(tmpLenWritten, qint64(0)));
+                if (tmpLenWritten == -1) {
+                    *err = QFileCopier::CannotWriteDestinationFile;
+                    return false;
+                }
+                lenWritten += tmpLenWritten;
+            }
+            if (hash)
+                hash->addData(buffer.data(), int(lenRead));
+
+            totalBytesWritten += lenWritten;
+            totalProgress += lenWritten;
+            if (totalFileSize < totalBytesWritten) {
+                totalFileSize = totalBytesWritten;
+            }
+        }
+
+        if (shouldEmitProgress || lenRead == 0) { // we need to emit signal at end of loop
+            {
+                TraceScope lockWait(&m_tracer, "lock", "wait for lock", m_currentId);
+                QWriteLocker l(&lock);
+                lockWait.end();
+                requests.setEntrySize(m_currentId, totalFileSize);
+                m_totalSize += totalFileSize - prevTotalFileSize;
+                m_totalProgress += totalProgress;
+                Job &job = jobs[r.job];
+                job.size += totalFileSize - prevTotalFileSize;
+                job.progress += totalProgress;
+                totalProgress = 0;
+                prevTotalFileSize = totalFileSize;
+                publishProgress();
+            }
+            shouldEmitProgress = false;
+            emit progress(totalBytesWritten, totalFileSize);
+        }
+
+    } while (lenRead != 0);
+
+    return true;
+}
+
+bool QFileCopierThread::copy(const Request &r, QFileCopier::Error *err)
+{
+    if (r.isDir) {
+
+        if (!createDir(r, err))
+            return false;
+
+        handleChildren(r);
+
+    } else {
+        return copyFile(r, err);
+    }
+
+    return true;
+}
+
+/*!
+  \internal
+
+    Renames entries on the same device; otherwise (or if CopyOnMove is set) copies entries
+    and removes each source as soon as it is copied.
+*/
+bool QFileCopierThread::move(const Request &r, QFileCopier::Error *err)
+{
+    bool result = true;
+    if (r.sameDevice) {
+
+        result = QFile::rename(r.source, r.dest);
+        if (!result && !r.isDir) { // device could be changed after gathering
+            result = copyFile(r, err);
+            if (result && *err == QFileCopier::NoError) // not canceled
+                result = remove(r, err);
+            return result;
+        }
+        if (!result) {
+            *err = QFileCopier::CannotRename;
+        }
+
+    } else {
+
+        if (r.isDir) {
+
+            if (!createDir(r, err))
+                return false;
+
+            handleChildren(r);
+
+            if (!QDir().rmdir(r.source)) {
+                *err = QFileCopier::CannotRemoveSource;
+                return false;
+            }
+
+        } else {
+            result = copyFile(r, err);
+            if (result && *err == QFileCopier::NoError) // not canceled
+                result = remove(r, err);
+        }
+
+    }
+    return result;
+}
+
+/*!
+  \internal
+
+    Copies or moves directory \a r over existing destination with AtomicOverwrite: the tree is
+    built in a hidden sibling which is exchanged with the destination once it is complete, and
+    old tree is removed in background. Destination is left as it was if the tree cannot be
+    built or copying is canceled.
+*/
+bool QFileCopierThread::replaceDirectory(const Request &r, QFileCopier::Error *err)
+{
+    int id = m_currentId;
+    QString tempPath = QFileRemover::hiddenPath(r.dest, QLatin1String("part"));
+    if (!rebaseDestinations(id, r.dest, tempPath)) {
+        rebaseDestinations(id, tempPath, r.dest);
+        *err = QFileCopier::CannotStoreRequest;
+        return false;
+    }
+
+    Request temp = r;
+    temp.dest = tempPath;
+    bool result = r.type == Task::Copy ? copy(temp, err) : move(temp, err);
+    if (result && *err == QFileCopier::NoError && !QFileRemover::exchangePaths(tempPath, r.dest)) {
+        *err = QFileCopier::CannotRemoveDestinationFile;
+        result = false;
+    }
+
+    // old tree is at temporary path after exchange, otherwise incomplete copy is
+    rebaseDestinations(id, tempPath, r.dest);
+    if (QFileInfo(tempPath).exists())
+        QFileRemover::removePathInBackground(tempPath);
+    return result;
+}
+
+bool QFileCopierThread::link(const Request &r, QFileCopier::Error *err)
+{
+    bool result = QFile::link(r.source, r.dest);
+    if (!result) {
+        *err = QFileCopier::CannotCreateSymLink;
+    }
+    return result;
+}
+
+/*!
+  \internal
+
+    Recreates directories and hard links files, like cp -al does.
+*/
+bool QFileCopierThread::hardLink(const Request &r, QFileCopier::Error *err)
+{
+    if (r.isDir) {
+        if (!createDir(r, err))
+            return false;
+    } else if (!createHardLink(r.source, r.dest)) {
+        *err = QFileCopier::CannotCreateHardLink;
+        return false;
+    }
+
+    {
+        QWriteLocker l(&lock);
+        m_totalProgress += r.size;
+        jobs[r.job].progress += r.size;
+    }
+    emit progress(r.size, r.size);
+
+    if (r.isDir)
+        handleChildren(r);
+
+    return true;
+}
+
+bool QFileCopierThread::remove(const Request &r, QFileCopier::Error *err)
+{
+    bool result = true;
+
+    if (r.isDir) {
+
+        if (r.copyFlags & QFileCopier::FollowLinks) { // links' targets are removed one by one
+            handleChildren(r);
+            result = QDir().rmdir(r.source);
+        } else {
+            result = removePath(r.source, r.copyFlags, m_currentToken.data());
+        }
+
+    } else {
+        QFileInfo sourceInfo(r.source);
+        if (sourceInfo.isSymLink() && (r.copyFlags & QFileCopier::FollowLinks)) {
+            result &= QFile::remove(sourceInfo.symLinkTarget());
+        }
+        result &= QFile::remove(r.source);
+    }
+
+    if (!result && m_currentToken->isCanceled()) {
+        *err = QFileCopier::Canceled;
+        return true;
+    }
+
+    if (!result) {
+        *err = QFileCopier::CannotRemoveSource;
+    }
+
+    return result;
+}
+
+/*!
+  \internal
+
+    Appends entry to archive of the job; destination of the request is its path in the archive.
+    Partially written entry is dropped on failure or cancel, so the archive stays valid and
+    the entry can be retried.
+*/
+bool QFileCopierThread::archive(const Request &r, QFileCopier::Error *err)
+{
+    lock.lockForRead();
+    QSharedPointer<QTarWriter> writer = jobs.at(r.job).archive;
+    lock.unlock();
+
+    if (!writer || (!writer->isOpen() && !writer->open())) {
+        *err = QFileCopier::CannotOpenDestinationFile;
+        return false;
+    }
+
+    QFileInfo sourceInfo(r.source);
+    if (r.isDir) {
+        if (!writer->writeDirectory(r.dest, sourceInfo)) {
+            writer->abortEntry();
+            *err = QFileCopier::CannotWriteDestinationFile;
+            return false;
+        }
+        handleChildren(r);
+        return true;
+    }
+
+    if (sourceInfo.isSymLink() && !(r.copyFlags & QFileCopier::FollowLinks)) {
+        if (!writer->writeSymLink(r.dest, sourceInfo.symLinkTarget(), sourceInfo)) {
+            writer->abortEntry();
+            *err = QFileCopier::CannotWriteDestinationFile;
+            return false;
+        }
+        return true;
+    }
+
+    QFile sourceFile(r.source);
+    {
+        PhaseTimer timer(this, m_currentId, QFileCopier::OpenPhase);
+        if (!sourceFile.open(QFile::ReadOnly)) {
+            *err = QFileCopier::CannotOpenSourceFile;
+            return false;
+        }
+    }
+
+    // size in the header is fixed, so data appended meanwhile is not archived
+    qint64 size = sourceFile.size();
+    if (!writer->beginFile(r.dest, size, sourceInfo)) {
+        writer->abortEntry();
+        *err = QFileCopier::CannotWriteDestinationFile;
+        return false;
+    }
+
+    // copyData() may preempt, requests of this job must wait until the entry is finished
+    lock.lockForWrite();
+    archiveEntryJobs.append(r.job);
+    lock.unlock();
+    bool result = copyData(r, &sourceFile, writer->device(), size, 0, err);
+    lock.lockForWrite();
+    archiveEntryJobs.removeLast();
+    scheduleChanged = true; // postponed requests are taken at the next entry
+    lock.unlock();
+    if (result && *err != QFileCopier::Canceled && !writer->endFile()) {
+        *err = QFileCopier::CannotWriteDestinationFile;
+        result = false;
+    }
+    if (!result || *err == QFileCopier::Canceled)
+        writer->abortEntry();
+    return result;
+}
+
+/*!
+  \internal
+
+    Compares files copied by the job verified by \a job with their sources and reports each
+    one which differs or cannot be read. Files of canceled subtrees are not compared.
+*/
+void QFileCopierThread::verify(int job)
+{
+    lock.lockForRead();
+    QFileVerifier verifier(jobs.at(job).token);
+    QStack<int> stack;
+    const QList<int> &topRequests = jobs.at(jobs.at(job).verifies).topRequests;
+    for (int i = topRequests.size() - 1; i >= 0; i--)
+        stack.push(topRequests.at(i));
+    while (!stack.isEmpty()) {
+        int id = stack.pop();
+        Request r = requests.at(id);
+        if (r.type != Task::Copy || r.canceled)
+            continue;
+        if (r.isDir) {
+            for (int i = r.childRequests.size() - 1; i >= 0; i--)
+                stack.push(r.childRequests.at(i));
+        } else {
+            verifier.addFile(id, r.source, r.dest, r.copyFlags & QFileCopier::FollowLinks);
+        }
+    }
+    lock.unlock();
+
+    QList<int> mismatches = verifier.run(qMax(1, QThread::idealThreadCount()));
+
+    QWriteLocker l(&lock);
+    foreach (int id, mismatches)
+        emit error(id, QFileCopier::VerificationFailed, false);
+    if (!mismatches.isEmpty()) {
+        m_errorCount += mismatches.size();
+        jobs[job].hasError = true;
+        hasError = true;
+        publishProgress();
+    }
+    finishJob(job);
+}
+
+bool QFileCopierThread::processRequest(const Request &r, QFileCopier::Error *err)
+{
+    if (r.canceled || m_currentToken->isCanceled()) {
+        *err = QFileCopier::Canceled;
+        return true;
+    }
+
+// we skip this check to improve performance (if file removed after starting, we just coulnd't open/link it)
+//    if (!QFileInfo(r.source).exists()) {
+//        *err = QFileCopier::SourceNotExists;
+//        return false;
+//    }
+
+    if (r.type != Task::Archive && shouldOverwrite(r)) {
+        QFileInfo destInfo(r.dest);
+        if (destInfo.exists()) {
+            bool copied = r.type == Task::Copy || (r.type == Task::Move && !r.sameDevice);
+            bool result = true;
+            if (!(r.copyFlags & QFileCopier::AtomicOverwrite) || !copied
+                    || destInfo.isSymLink() || destInfo.isDir() != r.isDir) {
+                result = removePath(r.dest, r.copyFlags, m_currentToken.data());
+            } else if (r.isDir) {
+                return replaceDirectory(r, err);
+            } // else file is replaced by copyFile() when copy is complete
+            if (!result && m_currentToken->isCanceled()) {
+                *err = QFileCopier::Canceled;
+                return true;
+            }
+            if (!result) {
+                *err = QFileCopier::CannotRemoveDestinationFile;
+                return false;
+            }
+        }
+    }
+
+    switch (r.type) {
+    case Task::Copy :
+        return copy(r, err);
+    case Task::Move :
+        return move(r, err);
+    case Task::Link :
+        return link(r, err);
+    case Task::HardLink :
+        return hardLink(r, err);
+    case Task::Remove :
+        return remove(r, err);
+    case Task::Archive :
+        return archive(r, err);
+    default:
+        break;
+    }
+
+    return true;
+}
+
+void QFileCopierThread::handle(int id)
+{
+    int parentId = m_currentId;
+    CancelTokenPointer parentToken = m_currentToken;
+    bool shouldRevalidate = false;
+    bool shouldCheck = false;
+    TraceScope handling(&m_tracer, "request", "handle", id);
+    {
+        TraceScope lockWait(&m_tracer, "lock", "wait for lock", id);
+        QWriteLocker l(&lock);
+        lockWait.end();
+        if (requests.testFlag(id, RequestStore::Handled)) // preempted earlier
+            return;
+
+        // token of the parent is alive while children are handled, top requests use job's one
+        CancelTokenPointer token = tokens.value(requests.parent(id));
+        if (!token)
+            token = jobs.at(requests.job(id)).token;
+        m_currentToken = new CancelToken(token);
+        if (requests.testFlag(id, RequestStore::Canceled))
+            m_currentToken->cancel();
+        tokens.insert(id, m_currentToken);
+        requests.setFlag(id, RequestStore::Handled);
+        shouldRevalidate = jobs.at(requests.job(id)).revalidate;
+        shouldCheck = jobs.at(requests.job(id)).manifest;
+
+        emit started(id);
+        m_currentId = id;
+        publishProgress();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    bool done = false;
+    int attempts = 0;
+    QFileCopier::Error err = QFileCopier::NoError;
+    Request r = request(id);
+    bool checked = !shouldCheck || recheckRequest(id, &r);
+    while (checked && !done) {
+        done = (!shouldRevalidate || revalidate(id, &r, &err)) && processRequest(r, &err);
+        done = interact(id, r, done, err);
+        attempts++;
+        if (!done)
+            refreshFlags(id, &r);
+    }
+
+    if (err != QFileCopier::NoError)
+        hasError = true;
+
+    {
+        QWriteLocker l(&lock);
+        if (!r.isDir) {
+            m_finishedFiles++;
+            // time spent waiting for user would distort the estimate
+            if (err == QFileCopier::NoError && attempts == 1) {
+                qint64 size = requests.entrySize(id); // could be updated while copying
+                estimator.addFile(size, timer.nsecsElapsed());
+                addLatency(QFileCopier::CopyLatency, size, timer.nsecsElapsed());
+            }
+        }
+        if (err != QFileCopier::NoError)
+            jobs[r.job].hasError = true;
+        tokens.remove(id);
+        m_currentToken = parentToken;
+        m_currentId = parentId;
+        publishProgress();
+        emit finished(id);
+    }
+}
+
+struct RequestPriorityGreater
+{
+    explicit RequestPriorityGreater(const RequestStore &store) : requests(store) {}
+    bool operator()(int a, int b) const { return requests.priority(a) > requests.priority(b); }
+
+    const RequestStore &requests;
+};
+
+void QFileCopierThread::handleChildren(const Request &r)
+{
+    QList<int> children = r.childRequests;
+    {
+        QReadLocker l(&lock);
+        foreach (int id, children) {
+            if (requests.priority(id) != 0) {
+                qStableSort(children.begin(), children.end(), RequestPriorityGreater(requests));
+                break;
+            }
+        }
+    }
+
+    foreach (int id, children) {
+        reschedule();
+        handle(id);
+    }
+}
+
+void QFileCopierThread::handleTopRequest(int id)
+{
+    handle(id);
+
+    QWriteLocker l(&lock);
+    finishJob(requests.job(id));
+}
+
+int QFileCopierPrivate::enqueueTasks(const QList<Task> &taskList, bool transient)
+{
+    int job = thread->enqueueTaskList(taskList, transient);
+
+    setState(QFileCopier::Copying);
+
+    return job;
+}
+
+int QFileCopierPrivate::enqueueOperation(Task::Type operationType, const QStringList &sourcePaths,
+                                         const QString &destinationPath, QFileCopier::CopyFlags flags)
+{
+    QList<Task> taskList;
+    taskList.reserve(sourcePaths.size());
+    foreach (const QString &path, sourcePaths) {
+        Task t;
+        t.source = path;
+        t.dest = destinationPath;
+        t.copyFlags = flags;
+        t.type = operationType;
+        taskList.append(t);
+    }
+    return enqueueTasks(taskList);
+}
+
+int QFileCopierPrivate::enqueueList(Task::Type operationType, QIODevice *sourceList, const QString &destinationPath,
+                                    QFileCopier::CopyFlags flags, QFileCopier::ListOptions options)
+{
+    Task t;
+    t.dest = destinationPath;
+    t.copyFlags = flags;
+    t.type = operationType;
+    int job = thread->enqueueTaskReader(new TaskReader(sourceList, options, t));
+
+    setState(QFileCopier::Copying);
+
+    return job;
+}
+
+void QFileCopierPrivate::onStarted(int id)
+{
+    requestStack.push(id);
+    emit q_func()->started(id);
+}
+
+void QFileCopierPrivate::onFinished(int id)
+{
+    requestStack.pop();
+    emit q_func()->finished(id, false);
+}
+
+void QFileCopierPrivate::onThreadFinished()
+{
+    setState(QFileCopier::Idle);
+}
+
+void QFileCopierPrivate::timerEvent(QTimerEvent *e)
+{
+    if (e->timerId() == progressTimerId) {
+        thread->emitProgress();
+        updateRates();
+    }
+}
+
+/*!
+  \internal
+
+    Updates exponentially weighted transfer rates on each progress tick.
+*/
+void QFileCopierPrivate::updateRates()
+{
+    const qreal weight = 0.3;
+
+    qint64 elapsed = rateTimer.restart();
+    qint64 progress = thread->totalProgress();
+    int finishedFiles = thread->finishedFiles();
+    if (elapsed > 0) {
+        bytesRate += weight * ((progress - lastProgress) * 1000.0 / elapsed - bytesRate);
+        filesRate += weight * ((finishedFiles - lastFinishedFiles) * 1000.0 / elapsed - filesRate);
+    }
+    lastProgress = progress;
+    lastFinishedFiles = finishedFiles;
+
+    if (state != QFileCopier::Idle)
+        emit q_func()->estimateChanged(q_func()->estimatedTimeRemaining());
+}
+
+/*!
+    \class QFileCopier
+
+    \brief The QFileCopier class allows you to copy and move files in a background process.
+*/
+QFileCopier::QFileCopier(QObject *parent) :
+    QObject(parent),
+    d_ptr(new QFileCopierPrivate(this))
+{
+    Q_D(QFileCopier);
+
+    qRegisterMetaType <QFileCopier::State> ("QFileCopier::State");
+    qRegisterMetaType <QFileCopier::Error> ("QFileCopier::Error");
+
+    d->thread = new QFileCopierThread(this);
+    connect(d->thread, SIGNAL(stateChanged(QFileCopier::State)), SIGNAL(stateChanged(QFileCopier::State)));
+    connect(d->thread, SIGNAL(started(int)), d, SLOT(onStarted(int)));
+    connect(d->thread, SIGNAL(finished(int)), d, SLOT(onFinished(int)));
+    connect(d->thread, SIGNAL(progress(qint64,qint64)), SIGNAL(progress(qint64,qint64)));
+    connect(d->thread, SIGNAL(error(int, QFileCopier::Error,bool)), SIGNAL(error(int, QFileCopier::Error,bool)));
+    connect(d->thread, SIGNAL(done(bool)), d, SLOT(onThreadFinished()));
+    connect(d->thread, SIGNAL(done(bool)), SIGNAL(done(bool)));
+    connect(d->thread, SIGNAL(jobFinished(int,bool)), SIGNAL(jobFinished(int,bool)));
+    d->state = Idle;
+
+    d->progressInterval = 500;
+    d->progressTimerId = d->startTimer(d->progressInterval);
+    d->autoReset = true;
+
+    d->rateTimer.start();
+    d->lastProgress = 0;
+    d->lastFinishedFiles = 0;
+    d->bytesRate = 0;
+    d->filesRate = 0;
+}
+
+QFileCopier::~QFileCopier()
+{
+    delete d_ptr;
+}
+
+int QFileCopier::copy(const QString &sourcePath, const QString &destinationPath, CopyFlags flags)
+{
+    return copy(QStringList() << sourcePath, destinationPath, flags);
+}
+
+int QFileCopier::copy(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags)
+{
+    return d_func()->enqueueOperation(Task::Copy, sourcePaths, destinationPath, flags);
+}
+
+/*!
+    Copies entries which paths are read from \a sourceList to \a destinationPath and returns
+    id of the job. Paths are separated by newlines or, with NulSeparated \a options, by '\0'.
+    With DestinationPairs, each path is followed by its own destination; relative
+    destinations are resolved against \a destinationPath. A path left without destination at
+    the end of the list is reported with MissingDestination error and is not copied.
+
+    The list is read by the copier thread in batches while entries are copied, so it is
+    never kept in memory as a whole. \a sourceList must stay open until the job is finished
+    and must be readable without an event loop, like QFile (including pipes and stdin)
+    or QBuffer.
+*/
+int QFileCopier::copy(QIODevice *sourceList, const QString &destinationPath, CopyFlags flags, ListOptions options)
+{
+    return d_func()->enqueueList(Task::Copy, sourceList, destinationPath, flags, options);
+}
+
+int QFileCopier::link(const QString &sourcePath, const QString &destinationPath, CopyFlags flags)
+{
+    return link(QStringList() << sourcePath, destinationPath, flags);
+}
+
+int QFileCopier::link(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags)
+{
+    return d_func()->enqueueOperation(Task::Link, sourcePaths, destinationPath, flags);
+}
+
+int QFileCopier::link(QIODevice *sourceList, const QString &destinationPath, CopyFlags flags, ListOptions options)
+{
+    return d_func()->enqueueList(Task::Link, sourceList, destinationPath, flags, options);
+}
+
+/*!
+    Clones tree at \a sourcePath: directories are created and files are hard linked, so no
+    data is copied. Every entry has size 1, thus progress of such job is counted in entries.
+*/
+int QFileCopier::hardLink(const QString &sourcePath, const QString &destinationPath, CopyFlags flags)
+{
+    return hardLink(QStringList() << sourcePath, destinationPath, flags);
+}
+
+int QFileCopier::hardLink(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags)
+{
+    return d_func()->enqueueOperation(Task::HardLink, sourcePaths, destinationPath, flags);
+}
+
+int QFileCopier::hardLink(QIODevice *sourceList, const QString &destinationPath, CopyFlags flags, ListOptions options)
+{
+    return d_func()->enqueueList(Task::HardLink, sourceList, destinationPath, flags, options);
+}
+
+int QFileCopier::move(const QString &sourcePath, const QString &destinationPath, CopyFlags flags)
+{
+    return move(QStringList() << sourcePath, destinationPath, flags);
+}
+
+int QFileCopier::move(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags)
+{
+    return d_func()->enqueueOperation(Task::Move, sourcePaths, destinationPath, flags);
+}
+
+int QFileCopier::move(QIODevice *sourceList, const QString &destinationPath, CopyFlags flags, ListOptions options)
+{
+    return d_func()->enqueueList(Task::Move, sourceList, destinationPath, flags, options);
+}
+
+/*!
+    Writes entries at \a sourcePath to a tar archive at \a archivePath in POSIX pax format,
+    instead of creating them one by one; existing archive is replaced. All requests of the job
+    are written to a single archive sequentially, which is completed when the job is finished.
+    Destinations of requests of the job are their paths in the archive.
+*/
+int QFileCopier::archive(const QString &sourcePath, const QString &archivePath, CopyFlags flags)
+{
+    return archive(QStringList() << sourcePath, archivePath, flags);
+}
+
+int QFileCopier::archive(const QStringList &sourcePaths, const QString &archivePath, CopyFlags flags)
+{
+    return d_func()->enqueueOperation(Task::Archive, sourcePaths, archivePath, flags);
+}
+
+int QFileCopier::archive(QIODevice *sourceList, const QString &archivePath, CopyFlags flags, ListOptions options)
+{
+    return d_func()->enqueueList(Task::Archive, sourceList, archivePath, flags, options & ~DestinationPairs);
+}
+
+/*!
+    Makes \a destinationPath identical to \a sourcePath: new and changed entries are copied,
+    and entries of destination directories which do not exist in source are removed.
+    Unlike copy(), \a destinationPath is the copy itself, not a directory to put it in.
+
+    Each directory is compared with a single listing of its destination. Files of the same size
+    which were modified after their source are considered up to date and are not copied.
+    Stale directories are removed in background while copying goes on. Entries excluded by
+    exclude filters are never removed, at any depth; stale directories containing them are
+    emptied of other entries but kept.
+*/
+int QFileCopier::mirror(const QString &sourcePath, const QString &destinationPath, CopyFlags flags)
+{
+    return d_func()->enqueueOperation(Task::Copy, QStringList() << sourcePath, destinationPath, flags | Mirror);
+}
+
+/*!
+    Mirrors \a sourcePath to \a destinationPath like mirror() and keeps it replicated until
+    stopWatching() is called. Returns id of the watch.
+
+    On Linux directories of source are watched with inotify, so only changed entries are
+    mirrored again. Changes are coalesced for a short delay and each batch is enqueued as a
+    separate job; once such job is finished, it is dropped with its requests and their ids
+    can be reused, so replication running for a long time does not grow the copier. If the event queue overflows or watches cannot be added, e.g. due to
+    fs.inotify.max_user_watches limit, the whole tree is mirrored again; on other platforms
+    it is mirrored periodically. Replication never asks for interaction, so NonInteractive
+    is always added to \a flags. Filters set when changes are flushed apply to them as they
+    apply to mirror().
+
+    Files are copied again when they are closed after writing, so a file which is kept open,
+    like a log, is not replicated until it is closed. Changes of permissions and times are
+    replicated too.
+
+    Returns -1 if \a destinationPath is \a sourcePath or is inside it, since each replicated
+    change would be watched and replicated again.
+
+    Watching is done in the thread of the copier and needs its event loop.
+*/
+int QFileCopier::watch(const QString &sourcePath, const QString &destinationPath, CopyFlags flags)
+{
+    Q_D(QFileCopier);
+
+    QString source = QDir::cleanPath(QFileInfo(sourcePath).absoluteFilePath());
+    QString dest = QDir::cleanPath(QFileInfo(destinationPath).absoluteFilePath());
+    if (dest == source || dest.startsWith(source + QLatin1Char('/')))
+        return -1;
+
+    QFileReplicator *replicator = new QFileReplicator(d, sourcePath, destinationPath, flags, d);
+    d->replicators.append(replicator);
+    replicator->start();
+    return d->replicators.size() - 1;
+}
+
+/*!
+    Stops replication started by watch() with id \a watch; jobs already enqueued are not
+    canceled.
+*/
+void QFileCopier::stopWatching(int watch)
+{
+    Q_D(QFileCopier);
+
+    if (watch < 0 || watch >= d->replicators.size())
+        return;
+
+    delete d->replicators.at(watch);
+    d->replicators[watch] = 0;
+}
+
+/*!
+    Compares files copied by \a job with their sources once nothing else is left to do, and
+    returns id of the verification job, or -1 if \a job does not exist.
+
+    Requests already gathered by \a job are reused, both sources and destinations are read
+    again in several threads. Each file which differs or cannot be read is reported by
+    error() with VerificationFailed and its request id; files which were skipped after an
+    error are reported too. Moved, linked and archived entries are not compared.
+*/
+int QFileCopier::verify(int job)
+{
+    Q_D(QFileCopier);
+
+    int verifyJob = d->thread->enqueueVerification(job);
+    if (verifyJob != -1)
+        d->setState(Copying);
+    return verifyJob;
+}
+
+int QFileCopier::remove(const QString &path, CopyFlags flags)
+{
+    return remove(QStringList() << path, flags);
+}
+
+int QFileCopier::remove(const QStringList &paths, CopyFlags flags)
+{
+    return d_func()->enqueueOperation(Task::Remove, paths, QString(), flags);
+}
+
+int QFileCopier::remove(QIODevice *pathList, CopyFlags flags, ListOptions options)
+{
+    return d_func()->enqueueList(Task::Remove, pathList, QString(), flags, options & ~DestinationPairs);
+}
+
+QList<int> QFileCopier::pendingRequests() const
+{
+    return d_func()->thread->pendingRequests(currentId());
+}
+
+QList<int> QFileCopier::topRequests() const
+{
+    return d_func()->thread->topRequests();
+}
+
+QString QFileCopier::sourceFilePath(int id) const
+{
+    return d_func()->thread->sourceFilePath(id);
+}
+
+QString QFileCopier::destinationFilePath(int id) const
+{
+    return d_func()->thread->destinationFilePath(id);
+}
+
+bool QFileCopier::isDir(int id) const
+{
+    return d_func()->thread->isDir(id);
+}
+
+QList<int> QFileCopier::entryList(int id) const
+{
+    return d_func()->thread->entryList(id);
+}
+
+int QFileCopier::currentId() const
+{
+    Q_D(const QFileCopier);
+    if (d->requestStack.isEmpty())
+        return -1;
+
+    return d->requestStack.top();
+}
+
+int QFileCopier::count() const
+{
+    return d_func()->thread->count();
+}
+
+qint64 QFileCopier::size(int id) const
+{
+    return d_func()->thread->size(id);
+}
+
+int QFileCopier::priority(int id) const
+{
+    return d_func()->thread->priority(id);
+}
+
+/*!
+    Sets \a priority of the request \a id; default is 0.
+
+    Pending request with priority higher than priority of the request being processed is
+    started as soon as current chunk is written, even if it is a child of directory that is
+    not processed yet.
+*/
+void QFileCopier::setPriority(int id, int priority)
+{
+    d_func()->thread->setPriority(id, priority);
+}
+
+qint64 QFileCopier::totalProgress() const
+{
+    return d_func()->thread->totalProgress();
+}
+
+qint64 QFileCopier::totalSize() const
+{
+    return d_func()->thread->totalSize();
+}
+
+/*!
+    Returns number of bytes that were not copied because files with the same contents were
+    cloned or linked instead; see Deduplicate. Duplicates are only looked up within a job and
+    counted until resetStatistics() is called.
+*/
+qint64 QFileCopier::deduplicatedSize() const
+{
+    return d_func()->thread->deduplicatedSize();
+}
+
+int QFileCopier::duplicateFiles() const
+{
+    return d_func()->thread->duplicateFiles();
+}
+
+/*!
+    Returns number of distinct contents which had at least one duplicate.
+*/
+int QFileCopier::duplicateGroups() const
+{
+    return d_func()->thread->duplicateGroups();
+}
+
+/*!
+    Returns number of bytes copied per second, averaged over recent progress intervals.
+*/
+qint64 QFileCopier::bytesPerSecond() const
+{
+    return qint64(d_func()->bytesRate);
+}
+
+/*!
+    Returns number of files processed per second, averaged over recent progress intervals.
+*/
+qreal QFileCopier::filesPerSecond() const
+{
+    return d_func()->filesRate;
+}
+
+/*!
+    Returns estimated number of milliseconds until all pending work is done, or -1 if it
+    cannot be estimated yet.
+
+    Estimate is based on time files of similar size took, so trees of many small files are
+    not estimated by byte rate only; until first file is finished, bytesPerSecond() is used.
+*/
+qint64 QFileCopier::estimatedTimeRemaining() const
+{
+    Q_D(const QFileCopier);
+
+    if (d->state == Idle)
+        return 0;
+
+    qint64 time = d->thread->estimatedTimeRemaining();
+    if (time == -1 && d->bytesRate >= 1)
+        time = qint64((totalSize() - totalProgress()) * 1000 / d->bytesRate);
+    return time;
+}
+
+/*!
+    Returns \a latency in nanoseconds which \a percentile percents of files did not exceed,
+    e.g. 99 for p99. If \a sizeClass is not -1, only files of that size class are counted.
+
+    Latencies are recorded for every file while statistics are enabled, see
+    setStatisticsEnabled(). Histograms are of fixed size, so results have about 6% precision;
+    CopyLatency is whole time of a file, OpenLatency covers opening of source and destination,
+    StatLatency checking of both paths.
+*/
+qint64 QFileCopier::latencyPercentile(Latency latency, qreal percentile, int sizeClass) const
+{
+    return d_func()->thread->latencyHistogram(latency, sizeClass).percentile(percentile);
+}
+
+qint64 QFileCopier::latencyCount(Latency latency, int sizeClass) const
+{
+    return d_func()->thread->latencyHistogram(latency, sizeClass).count();
+}
+
+qint64 QFileCopier::maxLatency(Latency latency, int sizeClass) const
+{
+    return d_func()->thread->latencyHistogram(latency, sizeClass).max();
+}
+
+void QFileCopier::resetLatencies()
+{
+    d_func()->thread->resetLatencies();
+}
+
+int QFileCopier::sizeClassCount()
+{
+    return SizeClassCount;
+}
+
+/*!
+    Returns size class of file of \a size bytes; classes end at 64 Kb, 1 Mb, 16 Mb and 256 Mb.
+*/
+int QFileCopier::sizeClass(qint64 size)
+{
+    return fileSizeClass(size);
+}
+
+/*!
+    Returns consistent snapshot of overall progress without taking any lock, so it can be
+    polled from any thread at high frequency without slowing down copying.
+*/
+QFileCopier::ProgressSnapshot QFileCopier::progressSnapshot() const
+{
+    return d_func()->thread->progressSnapshot();
+}
 
-    return true;
+/*!
+    Publishes progress snapshots also to a shared memory segment with \a key, so other
+    processes can read them with readSharedProgress(). Empty \a key releases the segment.
+
+    Returns false if segment cannot be created, also if a segment with \a key already exists.
+*/
+bool QFileCopier::setSharedMemoryKey(const QString &key)
+{
+    return d_func()->thread->setSharedMemoryKey(key);
 }
 
-bool QFileCopierThread::move(const Request &r, QFileCopier::Error *err)
+struct SharedProgressReaders
 {
-    // mounted folders?
-    bool result = true;
-    if (r.copyFlags & QFileCopier::CopyOnMove) {
+    ~SharedProgressReaders() { qDeleteAll(segments); }
 
-        if (r.isDir) {
+    QMutex mutex;
+    QHash<QString, QSharedMemory *> segments; // attachments are kept between reads
+};
 
-            if (!createDir(r, err))
-                return false;
+Q_GLOBAL_STATIC(SharedProgressReaders, sharedProgressReaders)
 
-            foreach (int id, r.childRequests) {
-                handle(id);
-            }
+/*!
+    Reads progress published by a QFileCopier in another process under \a key into
+    \a snapshot; never blocks the publishing process.
 
-            if (!QDir().rmdir(r.source)) {
-                *err = QFileCopier::CannotRemoveSource;
-                return false;
-            }
+    Segment is attached on first read and stays attached until its publisher releases it,
+    so polling costs only a few loads.
+*/
+bool QFileCopier::readSharedProgress(const QString &key, ProgressSnapshot *snapshot)
+{
+    SharedProgressReaders *readers = sharedProgressReaders();
+    QMutexLocker l(&readers->mutex);
 
-        } else {
-            result = copyFile(r, err);
-            if (result)
-                result = remove(r, err);
-        }
+    QSharedMemory *memory = readers->segments.value(key);
+    if (memory && static_cast<const SharedProgress *>(memory->constData())->released) {
+        delete readers->segments.take(key);
+        memory = 0;
+    }
 
-    } else {
-        result = QFile::rename(r.source, r.dest);
-        if (!result) {
-            *err = QFileCopier::CannotRename;
+    if (!memory) {
+        memory = new QSharedMemory(key);
+        if (!memory->attach(QSharedMemory::ReadOnly) || memory->size() < int(sizeof(SharedProgress))
+                || static_cast<const SharedProgress *>(memory->constData())->released) {
+            delete memory;
+            return false;
         }
+        readers->segments.insert(key, memory);
     }
-    return result;
+
+    *snapshot = static_cast<const SharedProgress *>(memory->constData())->read();
+    return true;
 }
 
-bool QFileCopierThread::link(const Request &r, QFileCopier::Error *err)
+bool QFileCopier::statisticsEnabled() const
 {
-    bool result = QFile::link(r.source, r.dest);
-    if (!result) {
-        *err = QFileCopier::CannotCreateSymLink;
-    }
-    return result;
+    return d_func()->thread->statisticsEnabled();
 }
 
-bool QFileCopierThread::remove(const Request &r, QFileCopier::Error *err)
-{
-    bool result = true;
+/*!
+    Enables collecting of timing statistics; disabled by default.
 
-    if (r.isDir) {
+    Each measured call costs two clock reads and a short lock; when disabled only a flag is
+    checked. Collected values are kept until resetStatistics() is called, which also resets
+    counters of duplicates.
+*/
+void QFileCopier::setStatisticsEnabled(bool on)
+{
+    d_func()->thread->setStatisticsEnabled(on);
+}
 
-        foreach (int id, r.childRequests) {
-            handle(id);
-        }
-        result = QDir().rmdir(r.source);
+void QFileCopier::resetStatistics()
+{
+    d_func()->thread->resetStatistics();
+}
 
-    } else {
-        QFileInfo sourceInfo(r.source);
-        if (sourceInfo.isSymLink() && (r.copyFlags & QFileCopier::FollowLinks)) {
-            result &= QFile::remove(sourceInfo.symLinkTarget());
-        }
-        result &= QFile::remove(r.source);
-    }
+/*!
+    Returns time in nanoseconds spent in \a phase by all requests.
 
-    if (!result) {
-        *err = QFileCopier::CannotRemoveSource;
-    }
+    GatheringPhase is measured for top requests only and includes their subtrees.
+*/
+qint64 QFileCopier::phaseTime(Phase phase) const
+{
+    return d_func()->thread->phaseStatistics(phase).time;
+}
 
-    return result;
+/*!
+    Returns number of bytes transferred in \a phase; only ReadPhase and WritePhase
+    transfer data.
+*/
+qint64 QFileCopier::phaseBytes(Phase phase) const
+{
+    return d_func()->thread->phaseStatistics(phase).bytes;
 }
 
-bool QFileCopierThread::processRequest(const Request &r, QFileCopier::Error *err)
+/*!
+    Returns number of measured calls of \a phase; each call is one system call or, for stat
+    phase, a check of source and destination.
+*/
+int QFileCopier::phaseCalls(Phase phase) const
 {
-    if (r.canceled) {
-        *err = QFileCopier::Canceled;
-        return true;
-    }
+    return d_func()->thread->phaseStatistics(phase).calls;
+}
 
-// we skip this check to improve performance (if file removed after starting, we just coulnd't open/link it)
-//    if (!QFileInfo(r.source).exists()) {
-//        *err = QFileCopier::SourceNotExists;
-//        return false;
-//    }
+/*!
+    Returns time in nanoseconds spent in all phases of request \a id, not counting its
+    child requests.
+*/
+qint64 QFileCopier::requestTime(int id) const
+{
+    RequestStatistics stats = d_func()->thread->requestStatistics(id);
+    qint64 time = 0;
+    for (int phase = 0; phase < PhaseCount; phase++)
+        time += stats.phases[phase].time;
+    return time;
+}
 
-    if (shouldOverwrite(r)) {
-        if (QFileInfo(r.dest).exists()) {
-            bool result = removePath(r.dest);
-            if (!result) {
-                *err = QFileCopier::CannotRemoveDestinationFile;
-                return false;
-            }
-        }
-    }
+qint64 QFileCopier::requestTime(int id, Phase phase) const
+{
+    return d_func()->thread->requestStatistics(id).phases[phase].time;
+}
 
-    switch (r.type) {
-    case Task::Copy :
-        return copy(r, err);
-    case Task::Move :
-        return move(r, err);
-    case Task::Link :
-        return link(r, err);
-    case Task::Remove :
-        return remove(r, err);
-    default:
-        break;
-    }
+/*!
+    Returns number of bytes written for request \a id.
+*/
+qint64 QFileCopier::requestBytes(int id) const
+{
+    return d_func()->thread->requestStatistics(id).phases[WritePhase].bytes;
+}
 
-    return true;
+int QFileCopier::requestCalls(int id) const
+{
+    RequestStatistics stats = d_func()->thread->requestStatistics(id);
+    int calls = 0;
+    for (int phase = 0; phase < PhaseCount; phase++)
+        calls += stats.phases[phase].calls;
+    return calls;
 }
 
-void QFileCopierThread::handle(int id)
+/*!
+    Returns bytes written per second of time spent in request \a id, or 0 if nothing
+    was measured.
+*/
+qint64 QFileCopier::requestThroughput(int id) const
 {
-    int parentId = m_currentId;
-    {
-        QWriteLocker l(&lock);
-        emit started(id);
-        m_currentId = id;
-    }
+    qint64 time = requestTime(id);
+    if (time <= 0)
+        return 0;
+    return qint64(double(requestBytes(id)) * 1000000000.0 / time);
+}
 
-    bool done = false;
-    QFileCopier::Error err = QFileCopier::NoError;
-    while (!done) {
-        Request r = request(id);
-        done = processRequest(r, &err);
-        done = interact(id, r, done, err);
-    }
+bool QFileCopier::tracingEnabled() const
+{
+    return d_func()->thread->tracer()->isEnabled();
+}
 
-    if (err != QFileCopier::NoError)
-        hasError = true;
+/*!
+    Enables recording of trace events: gathering, handling of each request, waits for lock
+    and for user, and each read and write call. Disabled by default.
 
-    {
-        QWriteLocker l(&lock);
-        m_currentId = parentId;
-        emit finished(id);
-    }
+    Events are kept in a ring buffer of traceBufferSize() events, so tracing can stay enabled
+    for long copies; only the most recent events are written by writeTrace().
+*/
+void QFileCopier::setTracingEnabled(bool on)
+{
+    d_func()->thread->tracer()->setEnabled(on);
 }
 
-void QFileCopierPrivate::enqueueOperation(Task::Type operationType, const QStringList &sourcePaths,
-                                          const QString &destinationPath, QFileCopier::CopyFlags flags)
+int QFileCopier::traceBufferSize() const
 {
-    QList<Task> taskList;
-    taskList.reserve(sourcePaths.size());
-    foreach (const QString &path, sourcePaths) {
-        Task t;
-        t.source = path;
-        t.dest = destinationPath;
-        t.copyFlags = flags;
-        t.type = operationType;
-        taskList.append(t);
-    }
-    thread->enqueueTaskList(taskList);
+    return d_func()->thread->tracer()->capacity();
+}
 
-    setState(QFileCopier::Copying);
+/*!
+    Sets number of kept trace \a events; default is 65536. Already recorded events are dropped.
+*/
+void QFileCopier::setTraceBufferSize(int events)
+{
+    d_func()->thread->tracer()->setCapacity(events);
 }
 
-void QFileCopierPrivate::onStarted(int id)
+/*!
+    Writes recorded events to \a device as Chrome trace JSON, which can be loaded into
+    chrome://tracing or Perfetto.
+*/
+bool QFileCopier::writeTrace(QIODevice *device) const
 {
-    requestStack.push(id);
-    emit q_func()->started(id);
+    return d_func()->thread->tracer()->write(device);
 }
 
-void QFileCopierPrivate::onFinished(int id)
+bool QFileCopier::writeTrace(const QString &fileName) const
 {
-    requestStack.pop();
-    emit q_func()->finished(id, false);
+    QFile file(fileName);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate))
+        return false;
+    return writeTrace(&file);
 }
 
-void QFileCopierPrivate::onThreadFinished()
+/*!
+    Writes gathered request tree of the \a job with sizes and flags to \a device as a binary
+    manifest, which can be executed later by executeManifest() without gathering it again.
+    Returns false if the job does not exist or is still being gathered.
+*/
+bool QFileCopier::saveManifest(int job, QIODevice *device) const
 {
-    setState(QFileCopier::Idle);
+    QDataStream out(device);
+    return d_func()->thread->saveManifest(job, out);
 }
 
-void QFileCopierPrivate::timerEvent(QTimerEvent *e)
+bool QFileCopier::saveManifest(int job, const QString &fileName) const
 {
-    if (e->timerId() == progressTimerId) {
-        thread->emitProgress();
-    }
+    QFile file(fileName);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate))
+        return false;
+    return saveManifest(job, &file);
 }
 
 /*!
-    \class QFileCopier
-
-    \brief The QFileCopier class allows you to copy and move files in a background process.
+    Enqueues requests read from manifest written by saveManifest() as a new job and returns
+    its id, or -1 if the manifest is damaged or cannot be stored. Sources are not gathered
+    again; destinations are checked when entries are handled, as they are when gathering, so
+    existing files are only overwritten when flags or answers saved with the job allow it.
+
+    If \a revalidate is true, each source is stated before it is handled: sources which no
+    longer exist or changed their type are reported with SourceNotExists error, and sizes of
+    files are updated.
 */
-QFileCopier::QFileCopier(QObject *parent) :
-    QObject(parent),
-    d_ptr(new QFileCopierPrivate(this))
+int QFileCopier::executeManifest(QIODevice *device, bool revalidate)
 {
     Q_D(QFileCopier);
 
-    qRegisterMetaType <QFileCopier::State> ("QFileCopier::State");
-    qRegisterMetaType <QFileCopier::Error> ("QFileCopier::Error");
+    QDataStream in(device);
+    QList<Request> list;
+    if (!readManifest(in, &list))
+        return -1;
 
-    d->thread = new QFileCopierThread(this);
-    connect(d->thread, SIGNAL(stateChanged(QFileCopier::State)), SIGNAL(stateChanged(QFileCopier::State)));
-    connect(d->thread, SIGNAL(started(int)), d, SLOT(onStarted(int)));
-    connect(d->thread, SIGNAL(finished(int)), d, SLOT(onFinished(int)));
-    connect(d->thread, SIGNAL(progress(qint64,qint64)), SIGNAL(progress(qint64,qint64)));
-    connect(d->thread, SIGNAL(error(int, QFileCopier::Error,bool)), SIGNAL(error(int, QFileCopier::Error,bool)));
-    connect(d->thread, SIGNAL(done(bool)), d, SLOT(onThreadFinished()));
-    connect(d->thread, SIGNAL(done(bool)), SIGNAL(done(bool)));
-    d->state = Idle;
+    int job = d->thread->enqueueManifest(list, revalidate);
+    d->setState(QFileCopier::Copying);
+    return job;
+}
 
-    d->progressInterval = 500;
-    d->progressTimerId = d->startTimer(d->progressInterval);
-    d->autoReset = true;
+int QFileCopier::executeManifest(const QString &fileName, bool revalidate)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly))
+        return -1;
+    return executeManifest(&file, revalidate);
 }
 
-QFileCopier::~QFileCopier()
+/*!
+    Returns id of the job that request \a id belongs to.
+*/
+int QFileCopier::jobId(int id) const
 {
-    delete d_ptr;
+    return d_func()->thread->jobId(id);
 }
 
-void QFileCopier::copy(const QString &sourcePath, const QString &destinationPath, CopyFlags flags)
+/*!
+    Returns top-level requests of the \a job, i.e. requests created for paths passed to
+    copy(), link(), move() or remove().
+*/
+QList<int> QFileCopier::jobRequests(int job) const
 {
-    copy(QStringList() << sourcePath, destinationPath, flags);
+    return d_func()->thread->job(job).topRequests;
 }
 
-void QFileCopier::copy(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags)
+qint64 QFileCopier::jobProgress(int job) const
 {
-    d_func()->enqueueOperation(Task::Copy, sourcePaths, destinationPath, flags);
+    return d_func()->thread->job(job).progress;
 }
 
-void QFileCopier::link(const QString &sourcePath, const QString &destinationPath, CopyFlags flags)
+qint64 QFileCopier::jobSize(int job) const
 {
-    link(QStringList() << sourcePath, destinationPath, flags);
+    return d_func()->thread->job(job).size;
 }
 
-void QFileCopier::link(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags)
+int QFileCopier::jobPriority(int job) const
 {
-    d_func()->enqueueOperation(Task::Link, sourcePaths, destinationPath, flags);
+    return d_func()->thread->job(job).priority;
 }
 
-void QFileCopier::move(const QString &sourcePath, const QString &destinationPath, CopyFlags flags)
+/*!
+    Sets \a priority of the \a job; default is 0.
+
+    Pending work of job with higher priority is started before work of jobs with lower
+    priority; job that is being processed is suspended between entries while more urgent
+    job is running.
+*/
+void QFileCopier::setJobPriority(int job, int priority)
 {
-    move(QStringList() << sourcePath, destinationPath, flags);
+    d_func()->thread->setJobPriority(job, priority);
 }
 
-void QFileCopier::move(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags)
+QFileCopier::State QFileCopier::state() const
 {
-    d_func()->enqueueOperation(Task::Move, sourcePaths, destinationPath, flags);
+    return d_func()->state;
 }
 
-void QFileCopier::remove(const QString &path, CopyFlags flags)
+/*!
+    Returns size of buffers used for reading and writing files; default is 64 Kb.
+*/
+int QFileCopier::bufferSize()
 {
-    remove(QStringList() << path, flags);
+    return QFileBufferPool::instance()->bufferSize();
 }
 
-void QFileCopier::remove(const QStringList &paths, CopyFlags flags)
+/*!
+    Sets \a size of I/O buffers, rounded up to whole pages, for all copiers in the process.
+*/
+void QFileCopier::setBufferSize(int size)
 {
-    d_func()->enqueueOperation(Task::Remove, paths, QString(), flags);
+    QFileBufferPool::instance()->setBufferSize(size);
 }
 
-QList<int> QFileCopier::pendingRequests() const
+/*!
+    Returns maximum memory used by I/O buffers of all copiers in the process; default is 64 Mb.
+*/
+qint64 QFileCopier::bufferMemoryLimit()
 {
-    return d_func()->thread->pendingRequests(currentId());
+    return QFileBufferPool::instance()->memoryLimit();
 }
 
-QList<int> QFileCopier::topRequests() const
+/*!
+    Sets maximum memory used by I/O buffers of all copiers to \a bytes. Buffers are page
+    aligned and reused between files; when the limit is reached, copier waits until another
+    one returns a buffer. Request which preempts another one reuses its buffer, and verify()
+    uses fewer threads when buffers are not free, so the limit is never exceeded. Files are
+    reported with CannotAllocateBuffer error if a buffer cannot be allocated.
+*/
+void QFileCopier::setBufferMemoryLimit(qint64 bytes)
 {
-    return d_func()->thread->topRequests();
+    QFileBufferPool::instance()->setMemoryLimit(bytes);
 }
 
-QString QFileCopier::sourceFilePath(int id) const
+bool QFileCopier::hugePagesEnabled()
 {
-    return d_func()->thread->request(id).source;
+    return QFileBufferPool::instance()->hugePagesEnabled();
 }
 
-QString QFileCopier::destinationFilePath(int id) const
+/*!
+    Enables huge pages for buffers of 2 Mb and larger, where the system supports them.
+*/
+void QFileCopier::setHugePagesEnabled(bool on)
 {
-    return d_func()->thread->request(id).dest;
+    QFileBufferPool::instance()->setHugePagesEnabled(on);
 }
 
-bool QFileCopier::isDir(int id) const
+QString QFileCopier::scratchDirectory() const
 {
-    return d_func()->thread->request(id).isDir;
+    return d_func()->thread->scratchDirectory();
 }
 
-QList<int> QFileCopier::entryList(int id) const
+/*!
+    Keeps table of requests in memory-mapped files in directory \a path instead of memory, so
+    paths and entry lists of large trees do not take memory; empty \a path keeps it in memory,
+    which is the default. Memory use is not bounded though: queues of request ids, tables of
+    hard links and duplicates and statistics of requests still take a few bytes per entry.
+    Entries which cannot be stored, e.g. because the disk is full, are reported with
+    CannotStoreRequest error.
+
+    Requests already enqueued are moved to the new location, which blocks copying meanwhile;
+    returns false, keeping them where they were, if files cannot be created in \a path or
+    requests do not fit there. Files are removed when copier is destroyed or directory is
+    changed again.
+*/
+bool QFileCopier::setScratchDirectory(const QString &path)
 {
-    return d_func()->thread->request(id).childRequests;
+    return d_func()->thread->setScratchDirectory(path);
 }
 
-int QFileCopier::currentId() const
+QList<QRegExp> QFileCopier::includeFilters() const
 {
-    Q_D(const QFileCopier);
-    if (d->requestStack.isEmpty())
-        return -1;
+    return d_func()->thread->filter().includes;
+}
 
-    return d->requestStack.top();
+/*!
+    Sets patterns of names of files found in copied directories which are copied; other files
+    are skipped. Empty list, which is the default, includes all files. Directories are always
+    descended unless excluded. Use QRegExp::Wildcard syntax for glob patterns.
+
+    Filters are applied to jobs enqueued after they are set, during gathering; paths passed to
+    copy(), link() and other functions are never filtered. Only copied, linked and archived
+    trees are filtered: move() and remove() always take whole trees, since a directory moved
+    within a device is renamed as a whole and a partially moved source could not be removed.
+*/
+void QFileCopier::setIncludeFilters(const QList<QRegExp> &filters)
+{
+    Q_D(QFileCopier);
+    FileFilter filter = d->thread->filter();
+    filter.includes = filters;
+    d->thread->setFilter(filter);
 }
 
-int QFileCopier::count() const
+QList<QRegExp> QFileCopier::excludeFilters() const
 {
-    return d_func()->thread->count();
+    return d_func()->thread->filter().excludes;
 }
 
-qint64 QFileCopier::size(int id) const
+/*!
+    Sets patterns of names of entries found in copied directories which are skipped.
+    Excluded directories are pruned: they are neither stated nor descended into.
+*/
+void QFileCopier::setExcludeFilters(const QList<QRegExp> &filters)
 {
-    return d_func()->thread->request(id).size;
+    Q_D(QFileCopier);
+    FileFilter filter = d->thread->filter();
+    filter.excludes = filters;
+    d->thread->setFilter(filter);
 }
 
-qint64 QFileCopier::totalProgress() const
+/*!
+    Skips files found in copied directories which are smaller than \a minSize or larger than
+    \a maxSize bytes; negative \a maxSize does not limit size.
+*/
+void QFileCopier::setSizeFilter(qint64 minSize, qint64 maxSize)
 {
-    return d_func()->thread->totalProgress();
+    Q_D(QFileCopier);
+    FileFilter filter = d->thread->filter();
+    filter.minSize = minSize;
+    filter.maxSize = maxSize;
+    d->thread->setFilter(filter);
 }
 
-qint64 QFileCopier::totalSize() const
+/*!
+    Skips files found in copied directories which were modified before \a after or not before
+    \a before; invalid date does not limit the range.
+*/
+void QFileCopier::setModifiedFilter(const QDateTime &after, const QDateTime &before)
 {
-    return d_func()->thread->totalSize();
+    Q_D(QFileCopier);
+    FileFilter filter = d->thread->filter();
+    filter.modifiedAfter = after;
+    filter.modifiedBefore = before;
+    d->thread->setFilter(filter);
 }
 
-QFileCopier::State QFileCopier::state() const
+void QFileCopier::clearFilters()
 {
-    return d_func()->state;
+    d_func()->thread->setFilter(FileFilter());
 }
 
 bool QFileCopier::autoReset() const
@@ -1032,6 +4054,11 @@ void QFileCopier::cancel(int id)
     d_func()->thread->cancel(id);
 }
 
+void QFileCopier::cancelJob(int job)
+{
+    d_func()->thread->cancelJob(job);
+}
+
 void QFileCopier::skip()
 {
     d_func()->thread->skip();
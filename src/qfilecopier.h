@@ -5,6 +5,9 @@
 
 #include <QtCore/QObject>
 
+class QDateTime;
+class QIODevice;
+class QRegExp;
 class QFileCopierPrivate;
 class QFILECOPIERSHARED_EXPORT QFileCopier : public QObject
 {
@@ -29,10 +32,22 @@ public:
         Force = 0x02,
         //        CancelOnError = 0x04,
         FollowLinks = 0x08, // if not set links are copied
-        CopyOnMove = 0x10
+        CopyOnMove = 0x10, // copy even if entries can be renamed
+        RemoveInBackground = 0x20, // removed and overwritten dirs are hidden and removed in background
+        AtomicOverwrite = 0x40, // overwritten entries are built aside and replace destination
+                                // only when complete; old dirs are removed in background
+        PreserveHardLinks = 0x80, // files hard linked in source are hard linked in destination
+        Deduplicate = 0x100, // files with equal contents are copied once, others are cloned or linked
+        Mirror = 0x200 // destination is made identical to source, see mirror()
     };
     Q_DECLARE_FLAGS(CopyFlags, CopyFlag)
 
+    enum ListOption {
+        NulSeparated = 0x01, // paths are separated by '\0', as printed by find -print0, not by newlines
+        DestinationPairs = 0x02 // each source path is followed by its own destination path
+    };
+    Q_DECLARE_FLAGS(ListOptions, ListOption)
+
     enum Error {
         NoError,
         SourceNotExists,
@@ -47,21 +62,73 @@ public:
         CannotWriteDestinationFile,
         CannotRemoveSource,
         CannotRename,
-        Canceled
+        Canceled,
+        CannotCreateHardLink,
+        VerificationFailed,
+        CannotStoreRequest,
+        MissingDestination,
+        CannotAllocateBuffer
     };
     Q_ENUMS(Error)
 
-    void copy(const QString &sourcePath, const QString &destinationPath, CopyFlags flags = 0);
-    void copy(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags = 0);
+    enum Phase {
+        GatheringPhase,
+        StatPhase,
+        OpenPhase,
+        ReadPhase,
+        WritePhase,
+        ClosePhase
+    };
+    Q_ENUMS(Phase)
+
+    enum Latency {
+        CopyLatency,
+        OpenLatency,
+        StatLatency
+    };
+    Q_ENUMS(Latency)
+
+    struct ProgressSnapshot
+    {
+        int state;
+        int currentId;
+        int currentJob;
+        int requests;
+        int totalFiles;
+        int finishedFiles;
+        int errors;
+        qint64 totalProgress;
+        qint64 totalSize;
+    };
+
+    int copy(const QString &sourcePath, const QString &destinationPath, CopyFlags flags = 0);
+    int copy(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags = 0);
+    int copy(QIODevice *sourceList, const QString &destinationPath, CopyFlags flags = 0, ListOptions options = 0);
+
+    int link(const QString &sourcePath, const QString &destinationPath, CopyFlags flags = 0);
+    int link(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags = 0);
+    int link(QIODevice *sourceList, const QString &destinationPath, CopyFlags flags = 0, ListOptions options = 0);
 
-    void link(const QString &sourcePath, const QString &destinationPath, CopyFlags flags = 0);
-    void link(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags = 0);
+    int hardLink(const QString &sourcePath, const QString &destinationPath, CopyFlags flags = 0);
+    int hardLink(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags = 0);
+    int hardLink(QIODevice *sourceList, const QString &destinationPath, CopyFlags flags = 0, ListOptions options = 0);
 
-    void move(const QString &sourcePath, const QString &destinationPath, CopyFlags flags = 0);
-    void move(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags = 0);
+    int move(const QString &sourcePath, const QString &destinationPath, CopyFlags flags = 0);
+    int move(const QStringList &sourcePaths, const QString &destinationPath, CopyFlags flags = 0);
+    int move(QIODevice *sourceList, const QString &destinationPath, CopyFlags flags = 0, ListOptions options = 0);
 
-    void remove(const QString &path, CopyFlags flags = 0);
-    void remove(const QStringList &paths, CopyFlags flags = 0);
+    int archive(const QString &sourcePath, const QString &archivePath, CopyFlags flags = 0);
+    int archive(const QStringList &sourcePaths, const QString &archivePath, CopyFlags flags = 0);
+    int archive(QIODevice *sourceList, const QString &archivePath, CopyFlags flags = 0, ListOptions options = 0);
+
+    int mirror(const QString &sourcePath, const QString &destinationPath, CopyFlags flags = 0);
+    int watch(const QString &sourcePath, const QString &destinationPath, CopyFlags flags = 0);
+    int verify(int job);
+    void stopWatching(int watch);
+
+    int remove(const QString &path, CopyFlags flags = 0);
+    int remove(const QStringList &paths, CopyFlags flags = 0);
+    int remove(QIODevice *pathList, CopyFlags flags = 0, ListOptions options = 0);
 
     QList<int> pendingRequests() const;
     QList<int> topRequests() const;
@@ -72,12 +139,82 @@ public:
     int currentId() const;
     int count() const;
     qint64 size(int id) const;
+    int priority(int id) const;
+    void setPriority(int id, int priority);
 
     qint64 totalProgress() const;
     qint64 totalSize() const;
 
+    qint64 deduplicatedSize() const;
+    int duplicateFiles() const;
+    int duplicateGroups() const;
+
+    qint64 bytesPerSecond() const;
+    qreal filesPerSecond() const;
+    qint64 estimatedTimeRemaining() const;
+
+    qint64 latencyPercentile(Latency latency, qreal percentile, int sizeClass = -1) const;
+    qint64 latencyCount(Latency latency, int sizeClass = -1) const;
+    qint64 maxLatency(Latency latency, int sizeClass = -1) const;
+    void resetLatencies();
+    static int sizeClassCount();
+    static int sizeClass(qint64 size);
+
+    ProgressSnapshot progressSnapshot() const;
+    bool setSharedMemoryKey(const QString &key);
+    static bool readSharedProgress(const QString &key, ProgressSnapshot *snapshot);
+
+    bool statisticsEnabled() const;
+    void setStatisticsEnabled(bool on);
+    void resetStatistics();
+    qint64 phaseTime(Phase phase) const;
+    qint64 phaseBytes(Phase phase) const;
+    int phaseCalls(Phase phase) const;
+    qint64 requestTime(int id) const;
+    qint64 requestTime(int id, Phase phase) const;
+    qint64 requestBytes(int id) const;
+    int requestCalls(int id) const;
+    qint64 requestThroughput(int id) const;
+
+    bool tracingEnabled() const;
+    void setTracingEnabled(bool on);
+    int traceBufferSize() const;
+    void setTraceBufferSize(int events);
+    bool writeTrace(QIODevice *device) const;
+    bool writeTrace(const QString &fileName) const;
+
+    bool saveManifest(int job, QIODevice *device) const;
+    bool saveManifest(int job, const QString &fileName) const;
+    int executeManifest(QIODevice *device, bool revalidate = false);
+    int executeManifest(const QString &fileName, bool revalidate = false);
+
+    int jobId(int id) const;
+    QList<int> jobRequests(int job) const;
+    qint64 jobProgress(int job) const;
+    qint64 jobSize(int job) const;
+    int jobPriority(int job) const;
+    void setJobPriority(int job, int priority);
+
     State state() const;
 
+    static int bufferSize();
+    static void setBufferSize(int size);
+    static qint64 bufferMemoryLimit();
+    static void setBufferMemoryLimit(qint64 bytes);
+    static bool hugePagesEnabled();
+    static void setHugePagesEnabled(bool on);
+
+    QString scratchDirectory() const;
+    bool setScratchDirectory(const QString &path);
+
+    QList<QRegExp> includeFilters() const;
+    void setIncludeFilters(const QList<QRegExp> &filters);
+    QList<QRegExp> excludeFilters() const;
+    void setExcludeFilters(const QList<QRegExp> &filters);
+    void setSizeFilter(qint64 minSize, qint64 maxSize = -1);
+    void setModifiedFilter(const QDateTime &after, const QDateTime &before);
+    void clearFilters();
+
     void setAutoReset(bool on);
     bool autoReset() const;
     int progressInterval() const;
@@ -88,6 +225,7 @@ public:
 public slots:
     void cancelAll();
     void cancel(int id);
+    void cancelJob(int job);
 
     void skip();
     void skipAll();
@@ -115,7 +253,9 @@ signals:
     void started(int id);
     void progress(qint64 progress, qint64 size);
     void finished(int id, bool error);
+    void jobFinished(int job, bool error);
     void canceled();
+    void estimateChanged(qint64 msecsRemaining);
 
 private:
     QFileCopierPrivate *d_ptr;
@@ -123,4 +263,6 @@ private:
     Q_DISABLE_COPY(QFileCopier)
 };
 
+Q_DECLARE_OPERATORS_FOR_FLAGS(QFileCopier::ListOptions)
+
 #endif // QFILECOPIER_H
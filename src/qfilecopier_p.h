@@ -2,41 +2,119 @@
 #define QFILECOPIER_P_H
 
 #include "qfilecopier.h"
+#include "qfilecopiertracer_p.h"
+#include "qtarwriter_p.h"
 
+#include <QtCore/QAtomicInt>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDataStream>
+#include <QtCore/QDateTime>
 #include <QtCore/QDir>
 #include <QtCore/QDirIterator>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QFileInfo>
+#include <QtCore/QHash>
 #include <QtCore/QMutex>
+#include <QtCore/QPair>
 #include <QtCore/QQueue>
 #include <QtCore/QReadWriteLock>
+#include <QtCore/QRegExp>
 #include <QtCore/QSet>
+#include <QtCore/QSharedData>
+#include <QtCore/QSharedMemory>
+#include <QtCore/QSharedPointer>
 #include <QtCore/QStack>
 #include <QtCore/QThread>
+#include <QtCore/QVector>
 #include <QtCore/QWaitCondition>
 
+class QFileReplicator;
+
+class CancelToken : public QSharedData
+{
+public:
+    explicit CancelToken(const QExplicitlySharedDataPointer<CancelToken> &parent =
+                         QExplicitlySharedDataPointer<CancelToken>()) :
+        m_parent(parent) {}
+
+    void cancel() { m_canceled.fetchAndStoreOrdered(1); }
+
+    // walks up to the job token; cost depends on depth of the tree, not on its size
+    bool isCanceled() const
+    {
+        for (const CancelToken *t = this; t; t = t->m_parent.data()) {
+            if (t->m_canceled)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    QAtomicInt m_canceled;
+    QExplicitlySharedDataPointer<CancelToken> m_parent;
+};
+
+typedef QExplicitlySharedDataPointer<CancelToken> CancelTokenPointer;
+
 struct Task
 {
-    enum Type { NoType = -1, Copy, Move, Remove, Link };
-    Task() : type(NoType), copyFlags(0) {}
-    Task(const Task &t) : type(t.type), source(t.source), dest(t.dest), copyFlags(t.copyFlags) {}
+    enum Type { NoType = -1, Copy, Move, Remove, Link, HardLink, Archive };
+    Task() : type(NoType), copyFlags(0), job(-1) {}
+    Task(const Task &t) : type(t.type), source(t.source), dest(t.dest), copyFlags(t.copyFlags), job(t.job) {}
 
     Type type;
     QString source;
     QString dest;
     QFileCopier::CopyFlags copyFlags;
+    int job;
+};
+
+/*!
+  \internal
+
+    Reads tasks from a list of paths on demand, so the list is never kept in memory as a whole.
+    Used only by the copier thread.
+*/
+class TaskReader
+{
+public:
+    TaskReader(QIODevice *device, QFileCopier::ListOptions options, const Task &task);
+
+    void setJob(int job) { m_task.job = job; }
+    bool read(Task *t);
+    bool takeUnpaired(Task *t);
+
+private:
+    bool readEntry(QByteArray *entry);
+
+    QIODevice *m_device;
+    QFileCopier::ListOptions m_options;
+    Task m_task; // type, destination and flags of each task
+    QByteArray m_buffer;
+    int m_position;
+    bool m_atEnd;
+    bool m_unpaired; // last source of DestinationPairs list has no destination
+    Task m_unpairedTask;
 };
 
 struct Request : public Task
 {
     Request() :
-        isDir(false), size(0), canceled(false), rename(false), overwrite(false), merge(false) {}
+        parent(-1), isDir(false), size(0), priority(0), handled(false), sameDevice(false), linkTo(-1),
+        canceled(false), rename(false), overwrite(false), merge(false) {}
     explicit Request(const Task &t) :
         Task(t),
-        isDir(false), size(0), canceled(false), rename(false), overwrite(false), merge(false) {}
+        parent(-1), isDir(false), size(0), priority(0), handled(false), sameDevice(false), linkTo(-1),
+        canceled(false), rename(false), overwrite(false), merge(false) {}
 
+    int parent;
     bool isDir;
     QList<int> childRequests;
     qint64 size;
+    int priority;
+    bool handled;
+    bool sameDevice; // move is done by renaming
+    int linkTo; // request which destination is hard linked instead of copying
 
     bool canceled;
     bool rename;
@@ -44,6 +122,282 @@ struct Request : public Task
     bool merge;
 };
 
+class QTemporaryFile;
+struct RequestRecord;
+
+/*!
+  \internal
+
+    Table of requests indexed by id. By default requests are kept in memory; with a scratch
+    directory set, they are kept in memory-mapped files there, so memory use does not depend on
+    size of the job. Whole requests are returned by value and changed with replace(); single
+    fields are read and written in place, without copying the request. Functions which add data
+    return false if files cannot grow, e.g. when the disk is full; the store is unchanged then.
+*/
+class RequestStore
+{
+public:
+    enum Flag {
+        IsDir = 0x01,
+        Handled = 0x02,
+        SameDevice = 0x04,
+        Canceled = 0x08,
+        Rename = 0x10,
+        Overwrite = 0x20,
+        Merge = 0x40
+    };
+
+    RequestStore();
+    ~RequestStore();
+
+    QString path() const { return m_path; }
+    bool setPath(const QString &directory);
+
+    int size() const;
+    Request at(int id) const;
+    Request value(int id) const;
+    bool append(const Request &request);
+    bool replace(int id, const Request &request);
+    void truncate(int size);
+    void setCheckpoint(int size);
+
+    int job(int id) const;
+    int parent(int id) const;
+    int priority(int id) const;
+    qint64 entrySize(int id) const;
+    QString source(int id) const;
+    QString dest(int id) const;
+    QList<int> childRequests(int id) const;
+    bool testFlag(int id, Flag flag) const;
+
+    void setPriority(int id, int priority);
+    void setEntrySize(int id, qint64 size);
+    bool setChildRequests(int id, const QList<int> &children);
+    void setFlag(int id, Flag flag, bool on = true);
+
+private:
+    static bool &flagField(Request &request, Flag flag);
+
+    RequestRecord *record(int id) const;
+    bool reserve(QFile *file, uchar **data, qint64 *capacity, qint64 size);
+    qint64 appendData(const void *data, qint64 size);
+    bool equalData(qint64 offset, const void *data, qint64 size) const;
+    void swap(RequestStore &other);
+    void closeFiles();
+
+    QList<Request> m_requests;
+
+    QString m_path;
+    int m_count;
+    QTemporaryFile *m_recordFile;
+    uchar *m_records;
+    qint64 m_recordCapacity;
+    QTemporaryFile *m_dataFile;
+    uchar *m_data;
+    qint64 m_dataSize;
+    qint64 m_dataCapacity;
+    int m_checkpoint; // requests below it use data only up to m_checkpointDataSize
+    qint64 m_checkpointDataSize;
+
+    Q_DISABLE_COPY(RequestStore)
+};
+
+typedef QPair<quint64, quint64> FileId; // device and inode
+
+enum { PhaseCount = QFileCopier::ClosePhase + 1 };
+
+struct PhaseStatistics
+{
+    PhaseStatistics() : time(0), bytes(0), calls(0) {}
+
+    void add(const PhaseStatistics &other)
+    {
+        time += other.time;
+        bytes += other.bytes;
+        calls += other.calls;
+    }
+
+    qint64 time; // nanoseconds
+    qint64 bytes;
+    int calls;
+};
+
+struct RequestStatistics
+{
+    PhaseStatistics phases[PhaseCount];
+};
+
+/*!
+  \internal
+
+    Include and exclude rules of a job. Exclude rules match names only, so excluded subtrees
+    are pruned without stating or descending them; other rules apply to files only.
+*/
+class FileFilter
+{
+public:
+    FileFilter() : minSize(0), maxSize(-1) {}
+
+    bool isNull() const;
+    bool isExcluded(const QString &name) const;
+    bool isIncluded(const QFileInfo &info) const;
+
+    QList<QRegExp> includes;
+    QList<QRegExp> excludes;
+    qint64 minSize;
+    qint64 maxSize; // negative if not limited
+    QDateTime modifiedAfter;
+    QDateTime modifiedBefore;
+};
+
+bool addStaleEntry(const QString &path, const FileFilter &filter, QStringList *paths);
+
+/*!
+  \internal
+
+    Compares copied files with their sources in a pool of threads. Each thread takes next file
+    when it is done with previous one, so a few large files do not hold back the rest.
+*/
+class QFileVerifier
+{
+public:
+    explicit QFileVerifier(const CancelTokenPointer &token);
+
+    void addFile(int id, const QString &source, const QString &dest, bool followLinks);
+    QList<int> run(int threadCount);
+
+private:
+    friend class VerifyRunnable;
+
+    struct Entry
+    {
+        int id;
+        QString source;
+        QString dest;
+        bool followLinks; // source links were copied as their targets
+    };
+
+    void work(char *buffer, int size);
+    bool compare(const Entry &entry, char *sourceBuffer, char *destBuffer, int blockSize) const;
+
+    CancelTokenPointer m_token;
+    QList<Entry> m_files;
+    QVector<char> m_equal; // each element is written by one thread only
+    QAtomicInt m_next;
+};
+
+struct Job
+{
+    Job() :
+        priority(0), pending(0), gathering(0), verifies(-1), progress(0), size(0), revalidate(false),
+        manifest(false), transient(false), firstRequest(0), canceled(false), hasError(false), overwriteAll(false), renameAll(false), mergeAll(false) {}
+
+    int priority;
+    int pending; // tasks and top requests not yet finished
+    int gathering; // tasks not yet gathered
+    int verifies; // job which files are compared by this one, -1 if it copies
+    QList<int> topRequests;
+    qint64 progress;
+    qint64 size;
+    bool revalidate; // loaded from manifest, sources are stated before handling
+    bool manifest; // loaded from manifest, destinations are checked before handling
+    bool transient; // enqueued by a replicator, dropped with its requests once finished
+    int firstRequest; // requests of the job are not below it
+    QSharedPointer<TaskReader> reader; // list of tasks which is not read to its end yet
+    QSharedPointer<QTarWriter> archive; // destinations of requests are paths in it
+    QSharedPointer<FileFilter> filter; // null if nothing is filtered
+    QHash<FileId, int> hardLinks; // first request for each gathered multiply linked file
+    QHash<qint64, int> sizeCounts; // gathered files of each size, only these are hashed
+    QSet<qint64> copiedSizes;
+    QHash<QByteArray, int> contents; // copied request for each content hash
+
+    bool canceled;
+    CancelTokenPointer token;
+    bool hasError;
+    bool overwriteAll;
+    bool renameAll;
+    bool mergeAll;
+    QSet<QFileCopier::Error> skipAllErrors;
+
+    // links and duplicates are only looked up within the job
+    void clearLinkTables()
+    {
+        hardLinks.clear();
+        sizeCounts.clear();
+        copiedSizes.clear();
+        contents.clear();
+    }
+};
+
+enum { SizeClassCount = 5 }; // files up to 64 Kb, 1 Mb, 16 Mb, 256 Mb and larger
+
+int fileSizeClass(qint64 size);
+
+class FileTimeEstimator
+{
+public:
+    FileTimeEstimator();
+
+    void addFile(qint64 size, qint64 time);
+    qint64 estimate(int files, qint64 bytes) const;
+
+private:
+    double m_time[SizeClassCount]; // averages in nanoseconds per file
+    double m_size[SizeClassCount];
+    bool m_sampled[SizeClassCount];
+};
+
+/*!
+  \internal
+
+    Progress published with a sequence lock: writer makes sequence odd while it updates the
+    snapshot, readers retry until sequence is even and same before and after copying, so
+    neither side ever waits for the other. Readers only load, so shared memory can be mapped
+    read-only. Layout is the same in process and in shared memory.
+*/
+struct SharedProgress
+{
+    void publish(const QFileCopier::ProgressSnapshot &snapshot);
+    QFileCopier::ProgressSnapshot read() const;
+
+    QAtomicInt sequence;
+    QAtomicInt released; // set when writer leaves the segment, readers attach again then
+    QFileCopier::ProgressSnapshot snapshot;
+};
+
+enum { LatencyCount = QFileCopier::StatLatency + 1 };
+
+/*!
+  \internal
+
+    Log-linear histogram of nanosecond values: each power of two is split into 16 buckets, so
+    values are kept with about 6% precision and size does not depend on number of values.
+*/
+class LatencyHistogram
+{
+public:
+    enum { SubBucketBits = 4, SubBucketCount = 1 << SubBucketBits,
+           BucketCount = 2 * SubBucketCount + (62 - SubBucketBits) * SubBucketCount };
+
+    LatencyHistogram();
+
+    void add(qint64 value);
+    void add(const LatencyHistogram &other);
+    void clear();
+
+    qint64 count() const { return m_count; }
+    qint64 max() const { return m_max; }
+    qint64 percentile(qreal percentile) const;
+
+private:
+    static int bucket(qint64 value);
+    static qint64 bucketUpperBound(int bucket);
+
+    quint32 m_counts[BucketCount];
+    qint64 m_count;
+    qint64 m_max;
+};
+
 class QFileCopierThread : public QThread
 {
     Q_OBJECT
@@ -54,7 +408,12 @@ public:
     explicit QFileCopierThread(QObject *parent = 0);
     ~QFileCopierThread();
 
-    void enqueueTaskList(const QList<Task> &list);
+    int createJob();
+    int enqueueTaskList(QList<Task> list, bool transient = false);
+    int enqueueTaskReader(TaskReader *reader);
+    int enqueueManifest(QList<Request> list, bool revalidate);
+    int enqueueVerification(int job);
+    bool saveManifest(int job, QDataStream &stream) const;
 
     QList<int> pendingRequests(int id) const;
     QList<int> topRequests() const;
@@ -63,12 +422,51 @@ public:
     void setState(QFileCopier::State);
 
     Request request(int id) const;
+    QString sourceFilePath(int id) const;
+    QString destinationFilePath(int id) const;
+    bool isDir(int id) const;
+    QList<int> entryList(int id) const;
+    qint64 size(int id) const;
+    int priority(int id) const;
+    int jobId(int id) const;
+    Job job(int id) const;
+    void setJobPriority(int job, int priority);
+    void setPriority(int id, int priority);
 
     int count() const;
 
+    QString scratchDirectory() const;
+    bool setScratchDirectory(const QString &path);
+
+    FileFilter filter() const;
+    void setFilter(const FileFilter &filter);
+
     qint64 totalProgress() const;
     qint64 totalSize() const;
 
+    qint64 deduplicatedSize() const;
+    int duplicateFiles() const;
+    int duplicateGroups() const;
+
+    bool statisticsEnabled() const { return m_statisticsEnabled; }
+    void setStatisticsEnabled(bool on);
+    void resetStatistics();
+    PhaseStatistics phaseStatistics(QFileCopier::Phase phase) const;
+    RequestStatistics requestStatistics(int id) const;
+    void addStatistics(int id, QFileCopier::Phase phase, qint64 time, qint64 bytes);
+
+    LatencyHistogram latencyHistogram(QFileCopier::Latency latency, int sizeClass) const;
+    void addLatency(QFileCopier::Latency latency, qint64 size, qint64 time);
+    void resetLatencies();
+
+    QFileCopier::ProgressSnapshot progressSnapshot() { return m_progress.read(); }
+    bool setSharedMemoryKey(const QString &key);
+
+    int finishedFiles() const;
+    qint64 estimatedTimeRemaining() const;
+
+    QFileCopierTracer *tracer() { return &m_tracer; }
+
     void setAutoReset(bool on);
 
     void waitForFinished(unsigned long msecs = ULONG_MAX);
@@ -77,6 +475,7 @@ public:
 
     void cancel();
     void cancel(int id);
+    void cancelJob(int job);
 
     void skip();
     void skipAll();
@@ -105,37 +504,93 @@ signals:
     void progress(qint64 progress, qint64 size);
     void error(int id, QFileCopier::Error error, bool stopped);
     void done(bool error);
+    void jobFinished(int job, bool error);
     void canceled();
 
 private:
+    bool takeNextTask(int minPriority, Task *t);
+    int takeNextReader(int minPriority);
+    void readTasks(int job);
+    void finishReader(int job);
+    bool takeNextRequest(int minPriority, int *id);
+    bool takeUrgentRequest(int minPriority, int *id, bool *top);
+    void finishJob(int job);
+    void dropFinishedJobs();
+    void closeArchive(int job);
+    void cancelRequest(int id);
+    void preempt(int id);
+    void reschedule();
+    bool isCanceled(const Request &r) const;
     void createRequest(Task r);
     bool shouldMerge(const Request &r);
     bool shouldOverwrite(const Request &r);
     bool shouldRename(const Request &r);
-    bool checkRequest(int id);
-    int addRequestToQueue(Request r);
+    void refreshFlags(int id, Request *r) const;
+    bool revalidate(int id, Request *r, QFileCopier::Error *err);
+    bool checkRequest(int id, Request *r);
+    bool recheckRequest(int id, Request *r);
+    bool rebaseDestinations(int id, const QString &from, const QString &to);
+    void publishProgress();
+    int addRequestToQueue(Request &r, const quint64 *destDevice = 0);
+    void storeFailed(int id, int job);
     bool interact(int id, const Request &r, bool done, QFileCopier::Error err);
     bool createDir(const Request &r, QFileCopier::Error *err);
     bool copyFile(const Request &r, QFileCopier::Error *err);
+    bool copyFile(const Request &r, const QString &dest, QCryptographicHash *hash, QFileCopier::Error *err);
+    bool copyData(const Request &r, QFile *sourceFile, QIODevice *destFile, qint64 maxSize,
+                  QCryptographicHash *hash, QFileCopier::Error *err);
+    bool hashFile(const QString &path, QByteArray *result);
+    bool linkDuplicate(const Request &r, const QString &path, QByteArray *contentHash);
+    bool replaceDirectory(const Request &r, QFileCopier::Error *err);
     bool copy(const Request &, QFileCopier::Error *);
     bool move(const Request &, QFileCopier::Error *);
     bool link(const Request &, QFileCopier::Error *);
+    bool hardLink(const Request &, QFileCopier::Error *);
     bool remove(const Request &, QFileCopier::Error *);
+    bool archive(const Request &, QFileCopier::Error *);
+    void verify(int job);
     bool processRequest(const Request &, QFileCopier::Error *);
     void handle(int id);
+    void handleChildren(const Request &r);
+    void handleTopRequest(int id);
     void overwriteChildren(int id);
 
 private:
     mutable QReadWriteLock lock;
 
     int m_currentId;
+    CancelTokenPointer m_currentToken;
+    QHash<int, CancelTokenPointer> tokens; // requests being handled
     QQueue<Task> taskQueue;
+    QList<int> readerJobs; // jobs which read their tasks from a list
+    QQueue<int> verifyJobs;
     QQueue<int> requestQueue;
+    QList<int> urgentRequests;
+    QList<int> archiveEntryJobs; // jobs writing data of an archive entry, nested by preemption
     QList<int> topRequestsList;
-    QList<Request> requests;
+    RequestStore requests;
+    QList<Job> jobs;
+    FileFilter m_filter; // copied to each new job
+    QSet<int> duplicatedContents;
+
+    volatile bool m_statisticsEnabled;
+    mutable QMutex statisticsLock; // statistics are updated per call, without the main lock
+    PhaseStatistics m_phaseStatistics[PhaseCount];
+    QHash<int, RequestStatistics> m_requestStatistics;
+    LatencyHistogram m_latencies[LatencyCount][SizeClassCount];
+
+    FileTimeEstimator estimator;
+    int m_totalFiles;
+    int m_finishedFiles;
+
+    QFileCopierTracer m_tracer;
+
+    SharedProgress m_progress;
+    QSharedMemory *sharedProgress;
 
     QFileCopier::State m_state;
     volatile bool shouldEmitProgress;
+    volatile bool scheduleChanged;
 
     QWaitCondition waitForFinishedCondition;
     QWaitCondition newCopyCondition;
@@ -145,13 +600,12 @@ private:
     bool stopRequest;
     bool skipAllRequest;
     bool cancelAllRequest;
-    bool overwriteAllRequest;
-    bool renameAllRequest;
-    bool mergeAllRequest;
 
     bool hasError;
-    QSet<QFileCopier::Error> skipAllError;
+    int m_errorCount;
 
+    qint64 m_deduplicatedSize;
+    int m_duplicateFiles;
     qint64 m_totalProgress;
     qint64 m_totalSize;
     bool autoReset;
@@ -172,10 +626,22 @@ public:
     int progressInterval;
     bool autoReset;
 
-    void enqueueOperation(Task::Type operationType, const QStringList &sourcePaths,
-                          const QString &destinationPath, QFileCopier::CopyFlags flags);
+    QElapsedTimer rateTimer;
+    qint64 lastProgress;
+    int lastFinishedFiles;
+    qreal bytesRate;
+    qreal filesRate;
+
+    QList<QFileReplicator *> replicators; // indexed by watch id, stopped ones are null
+
+    int enqueueTasks(const QList<Task> &taskList, bool transient = false);
+    int enqueueOperation(Task::Type operationType, const QStringList &sourcePaths,
+                         const QString &destinationPath, QFileCopier::CopyFlags flags);
+    int enqueueList(Task::Type operationType, QIODevice *sourceList, const QString &destinationPath,
+                    QFileCopier::CopyFlags flags, QFileCopier::ListOptions options);
 
     void setState(QFileCopier::State s);
+    void updateRates();
 
 public slots:
     void onStarted(int);
@@ -0,0 +1,459 @@
+#include "qfilecopier_p.h"
+
+#include <QtCore/QTemporaryFile>
+
+#include <string.h>
+
+struct RequestRecord
+{
+    qint64 size;
+    qint64 source; // offsets of variable length data in data file
+    qint64 dest;
+    qint64 children;
+    qint32 sourceLength;
+    qint32 destLength;
+    qint32 childCount;
+    qint32 type;
+    qint32 copyFlags;
+    qint32 job;
+    qint32 parent;
+    qint32 priority;
+    qint32 linkTo;
+    quint32 flags;
+};
+
+static const qint64 initialCapacity = 1024*1024;
+
+RequestStore::RequestStore() :
+    m_count(0),
+    m_recordFile(0),
+    m_records(0),
+    m_recordCapacity(0),
+    m_dataFile(0),
+    m_data(0),
+    m_dataSize(0),
+    m_dataCapacity(0),
+    m_checkpoint(0),
+    m_checkpointDataSize(0)
+{
+}
+
+RequestStore::~RequestStore()
+{
+    closeFiles();
+}
+
+/*!
+  \internal
+
+    Keeps requests in files created in \a directory; empty \a directory keeps them in
+    memory. Stored requests are copied to the new location under the same ids; if files
+    cannot be created or requests do not fit, the store is left unchanged.
+*/
+bool RequestStore::setPath(const QString &directory)
+{
+    RequestStore store;
+    store.m_path = directory;
+    if (!directory.isEmpty()) {
+        QString templateName = QDir(directory).absoluteFilePath(QLatin1String("qfilecopier-XXXXXX"));
+        store.m_recordFile = new QTemporaryFile(templateName + QLatin1String(".records"));
+        store.m_dataFile = new QTemporaryFile(templateName + QLatin1String(".data"));
+        if (!store.m_recordFile->open()
+                || !store.m_dataFile->open()
+                || !store.reserve(store.m_recordFile, &store.m_records, &store.m_recordCapacity, initialCapacity)
+                || !store.reserve(store.m_dataFile, &store.m_data, &store.m_dataCapacity, initialCapacity)) {
+            return false;
+        }
+    }
+
+    for (int id = 0; id < size(); id++) {
+        if (id == m_checkpoint)
+            store.setCheckpoint(id);
+        if (!store.append(at(id)))
+            return false;
+    }
+    if (m_checkpoint >= size())
+        store.setCheckpoint(m_checkpoint);
+
+    swap(store); // old files are removed with the temporary store
+    return true;
+}
+
+int RequestStore::size() const
+{
+    return m_recordFile ? m_count : m_requests.size();
+}
+
+Request RequestStore::at(int id) const
+{
+    if (!m_recordFile)
+        return m_requests.at(id);
+
+    const RequestRecord *r = record(id);
+    Request request;
+    request.type = Task::Type(r->type);
+    request.source = QString(reinterpret_cast<const QChar *>(m_data + r->source), r->sourceLength);
+    request.dest = QString(reinterpret_cast<const QChar *>(m_data + r->dest), r->destLength);
+    request.copyFlags = QFileCopier::CopyFlags(r->copyFlags);
+    request.job = r->job;
+    request.parent = r->parent;
+    request.size = r->size;
+    request.priority = r->priority;
+    request.linkTo = r->linkTo;
+
+    const qint32 *children = reinterpret_cast<const qint32 *>(m_data + r->children);
+    request.childRequests.reserve(r->childCount);
+    for (int i = 0; i < r->childCount; i++)
+        request.childRequests.append(children[i]);
+
+    request.isDir = r->flags & IsDir;
+    request.handled = r->flags & Handled;
+    request.sameDevice = r->flags & SameDevice;
+    request.canceled = r->flags & Canceled;
+    request.rename = r->flags & Rename;
+    request.overwrite = r->flags & Overwrite;
+    request.merge = r->flags & Merge;
+    return request;
+}
+
+Request RequestStore::value(int id) const
+{
+    if (id < 0 || id >= size())
+        return Request();
+    return at(id);
+}
+
+bool RequestStore::append(const Request &request)
+{
+    if (!m_recordFile) {
+        m_requests.append(request);
+        return true;
+    }
+
+    qint64 recordsSize = qint64(m_count + 1) * sizeof(RequestRecord);
+    if (!reserve(m_recordFile, &m_records, &m_recordCapacity, recordsSize))
+        return false;
+
+    RequestRecord *r = record(m_count++);
+    memset(r, 0, sizeof(RequestRecord));
+    if (!replace(m_count - 1, request)) {
+        m_count--;
+        return false;
+    }
+    return true;
+}
+
+/*!
+  \internal
+
+    Stores \a request under \a id. Paths and children which did not change are not written
+    again; data file is only appended to.
+*/
+bool RequestStore::replace(int id, const Request &request)
+{
+    if (!m_recordFile) {
+        m_requests[id] = request;
+        return true;
+    }
+
+    QVector<qint32> children;
+    children.reserve(request.childRequests.size());
+    foreach (int child, request.childRequests)
+        children.append(child);
+
+    RequestRecord r = *record(id);
+
+    qint64 sourceSize = request.source.size() * sizeof(QChar);
+    if (r.sourceLength != request.source.size() || !equalData(r.source, request.source.constData(), sourceSize)) {
+        if ((r.source = appendData(request.source.constData(), sourceSize)) == -1)
+            return false;
+        r.sourceLength = request.source.size();
+    }
+    qint64 destSize = request.dest.size() * sizeof(QChar);
+    if (r.destLength != request.dest.size() || !equalData(r.dest, request.dest.constData(), destSize)) {
+        if ((r.dest = appendData(request.dest.constData(), destSize)) == -1)
+            return false;
+        r.destLength = request.dest.size();
+    }
+    qint64 childrenSize = children.size() * sizeof(qint32);
+    if (r.childCount != children.size() || !equalData(r.children, children.constData(), childrenSize)) {
+        if ((r.children = appendData(children.constData(), childrenSize)) == -1)
+            return false;
+        r.childCount = children.size();
+    }
+
+    r.size = request.size;
+    r.type = request.type;
+    r.copyFlags = request.copyFlags;
+    r.job = request.job;
+    r.parent = request.parent;
+    r.priority = request.priority;
+    r.linkTo = request.linkTo;
+    r.flags = (request.isDir ? IsDir : 0)
+            | (request.handled ? Handled : 0)
+            | (request.sameDevice ? SameDevice : 0)
+            | (request.canceled ? Canceled : 0)
+            | (request.rename ? Rename : 0)
+            | (request.overwrite ? Overwrite : 0)
+            | (request.merge ? Merge : 0);
+
+    *record(id) = r; // data file could be remapped meanwhile, records file was not
+    if (id < m_checkpoint)
+        m_checkpointDataSize = m_dataSize;
+    return true;
+}
+
+/*!
+  \internal
+
+    Drops requests appended after first \a size ones. Their data is reused if \a size is the
+    checkpoint, otherwise it is left unused in data file.
+*/
+void RequestStore::truncate(int size)
+{
+    if (m_recordFile) {
+        m_count = qMin(m_count, size);
+        if (size == m_checkpoint)
+            m_dataSize = qMin(m_dataSize, m_checkpointDataSize);
+        return;
+    }
+
+    while (m_requests.size() > size)
+        m_requests.removeLast();
+}
+
+/*!
+  \internal
+
+    Remembers how much data first \a size requests use, so truncating back to them reuses
+    data of the rest. Data written for them later moves the checkpoint.
+*/
+void RequestStore::setCheckpoint(int size)
+{
+    m_checkpoint = size;
+    m_checkpointDataSize = m_dataSize;
+}
+
+int RequestStore::job(int id) const
+{
+    return m_recordFile ? record(id)->job : m_requests.at(id).job;
+}
+
+int RequestStore::parent(int id) const
+{
+    return m_recordFile ? record(id)->parent : m_requests.at(id).parent;
+}
+
+int RequestStore::priority(int id) const
+{
+    return m_recordFile ? record(id)->priority : m_requests.at(id).priority;
+}
+
+qint64 RequestStore::entrySize(int id) const
+{
+    return m_recordFile ? record(id)->size : m_requests.at(id).size;
+}
+
+QString RequestStore::source(int id) const
+{
+    if (!m_recordFile)
+        return m_requests.at(id).source;
+
+    const RequestRecord *r = record(id);
+    return QString(reinterpret_cast<const QChar *>(m_data + r->source), r->sourceLength);
+}
+
+QString RequestStore::dest(int id) const
+{
+    if (!m_recordFile)
+        return m_requests.at(id).dest;
+
+    const RequestRecord *r = record(id);
+    return QString(reinterpret_cast<const QChar *>(m_data + r->dest), r->destLength);
+}
+
+QList<int> RequestStore::childRequests(int id) const
+{
+    if (!m_recordFile)
+        return m_requests.at(id).childRequests;
+
+    const RequestRecord *r = record(id);
+    const qint32 *children = reinterpret_cast<const qint32 *>(m_data + r->children);
+    QList<int> result;
+    result.reserve(r->childCount);
+    for (int i = 0; i < r->childCount; i++)
+        result.append(children[i]);
+    return result;
+}
+
+bool RequestStore::testFlag(int id, Flag flag) const
+{
+    if (!m_recordFile)
+        return flagField(const_cast<Request &>(m_requests.at(id)), flag);
+    return record(id)->flags & flag;
+}
+
+void RequestStore::setPriority(int id, int priority)
+{
+    if (m_recordFile)
+        record(id)->priority = priority;
+    else
+        m_requests[id].priority = priority;
+}
+
+void RequestStore::setEntrySize(int id, qint64 size)
+{
+    if (m_recordFile)
+        record(id)->size = size;
+    else
+        m_requests[id].size = size;
+}
+
+bool RequestStore::setChildRequests(int id, const QList<int> &children)
+{
+    if (!m_recordFile) {
+        m_requests[id].childRequests = children;
+        return true;
+    }
+
+    QVector<qint32> data;
+    data.reserve(children.size());
+    foreach (int child, children)
+        data.append(child);
+
+    qint64 offset = appendData(data.constData(), data.size() * sizeof(qint32));
+    if (offset == -1)
+        return false;
+
+    RequestRecord *r = record(id);
+    r->children = offset;
+    r->childCount = data.size();
+    if (id < m_checkpoint)
+        m_checkpointDataSize = m_dataSize;
+    return true;
+}
+
+void RequestStore::setFlag(int id, Flag flag, bool on)
+{
+    if (!m_recordFile) {
+        flagField(m_requests[id], flag) = on;
+        return;
+    }
+
+    RequestRecord *r = record(id);
+    if (on)
+        r->flags |= flag;
+    else
+        r->flags &= ~quint32(flag);
+}
+
+bool &RequestStore::flagField(Request &request, Flag flag)
+{
+    switch (flag) {
+    case IsDir:
+        return request.isDir;
+    case Handled:
+        return request.handled;
+    case SameDevice:
+        return request.sameDevice;
+    case Canceled:
+        return request.canceled;
+    case Rename:
+        return request.rename;
+    case Overwrite:
+        return request.overwrite;
+    case Merge:
+    default:
+        return request.merge;
+    }
+}
+
+RequestRecord *RequestStore::record(int id) const
+{
+    return reinterpret_cast<RequestRecord *>(m_records) + id;
+}
+
+/*!
+  \internal
+
+    Grows \a file to hold at least \a size bytes, doubling its capacity, and maps it again.
+    Old mapping is kept if the file cannot grow.
+*/
+bool RequestStore::reserve(QFile *file, uchar **data, qint64 *capacity, qint64 size)
+{
+    if (size <= *capacity)
+        return true;
+
+    qint64 newCapacity = qMax(*capacity, initialCapacity);
+    while (newCapacity < size)
+        newCapacity *= 2;
+
+    if (!file->resize(newCapacity))
+        return false;
+
+    uchar *newData = file->map(0, newCapacity);
+    if (!newData)
+        return false;
+
+    if (*data)
+        file->unmap(*data);
+    *data = newData;
+    *capacity = newCapacity;
+    return true;
+}
+
+/*!
+  \internal
+
+    Appends \a data to data file and returns its offset, or -1 if the file cannot grow.
+*/
+qint64 RequestStore::appendData(const void *data, qint64 size)
+{
+    qint64 offset = m_dataSize;
+    if (size == 0)
+        return offset;
+
+    if (!reserve(m_dataFile, &m_data, &m_dataCapacity, m_dataSize + size))
+        return -1;
+
+    memcpy(m_data + offset, data, size);
+    m_dataSize += (size + 7) & ~Q_INT64_C(7); // keeps child lists aligned
+    return offset;
+}
+
+bool RequestStore::equalData(qint64 offset, const void *data, qint64 size) const
+{
+    return size == 0 || memcmp(m_data + offset, data, size) == 0;
+}
+
+void RequestStore::swap(RequestStore &other)
+{
+    m_requests.swap(other.m_requests);
+    qSwap(m_path, other.m_path);
+    qSwap(m_count, other.m_count);
+    qSwap(m_recordFile, other.m_recordFile);
+    qSwap(m_records, other.m_records);
+    qSwap(m_recordCapacity, other.m_recordCapacity);
+    qSwap(m_dataFile, other.m_dataFile);
+    qSwap(m_data, other.m_data);
+    qSwap(m_dataSize, other.m_dataSize);
+    qSwap(m_dataCapacity, other.m_dataCapacity);
+    qSwap(m_checkpoint, other.m_checkpoint);
+    qSwap(m_checkpointDataSize, other.m_checkpointDataSize);
+}
+
+void RequestStore::closeFiles()
+{
+    delete m_recordFile; // unmaps and removes the file
+    delete m_dataFile;
+    m_recordFile = 0;
+    m_dataFile = 0;
+    m_records = 0;
+    m_data = 0;
+    m_recordCapacity = 0;
+    m_dataCapacity = 0;
+    m_dataSize = 0;
+    m_count = 0;
+    m_checkpoint = 0;
+    m_checkpointDataSize = 0;
+}
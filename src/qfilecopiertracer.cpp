@@ -0,0 +1,119 @@
+#include "qfilecopiertracer_p.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QIODevice>
+#include <QtCore/QThread>
+
+QFileCopierTracer::QFileCopierTracer(int capacity) :
+    m_enabled(false),
+    m_events(capacity),
+    m_next(0),
+    m_wrapped(false)
+{
+    m_clock.start();
+}
+
+void QFileCopierTracer::setEnabled(bool on)
+{
+    m_enabled = on;
+}
+
+int QFileCopierTracer::capacity() const
+{
+    QMutexLocker l(&m_mutex);
+    return m_events.size();
+}
+
+/*!
+  \internal
+
+    Sets maximum number of kept events; recorded events are dropped.
+*/
+void QFileCopierTracer::setCapacity(int capacity)
+{
+    QMutexLocker l(&m_mutex);
+    m_events = QVector<TraceEvent>(qMax(1, capacity));
+    m_next = 0;
+    m_wrapped = false;
+}
+
+/*!
+  \internal
+
+    Stores complete event which started at \a start and ends now. Names are not copied, so
+    they must be string literals.
+*/
+void QFileCopierTracer::addEvent(const char *category, const char *name, qint64 start, int id, qint64 bytes)
+{
+    qint64 end = now();
+
+    QMutexLocker l(&m_mutex);
+    TraceEvent &event = m_events[m_next];
+    event.category = category;
+    event.name = name;
+    event.start = start;
+    event.duration = end - start;
+    event.id = id;
+    event.bytes = bytes;
+    event.thread = quintptr(QThread::currentThreadId());
+
+    if (++m_next == m_events.size()) {
+        m_next = 0;
+        m_wrapped = true;
+    }
+}
+
+/*!
+  \internal
+
+    Writes kept events to \a device in Chrome trace event format, oldest first; the result
+    can be opened in chrome://tracing or Perfetto.
+*/
+bool QFileCopierTracer::write(QIODevice *device) const
+{
+    QVector<TraceEvent> events;
+    {
+        QMutexLocker l(&m_mutex);
+        if (m_wrapped)
+            events = m_events.mid(m_next) + m_events.mid(0, m_next);
+        else
+            events = m_events.mid(0, m_next);
+    }
+
+    QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+    QByteArray data("{\"traceEvents\":[");
+    for (int i = 0; i < events.size(); i++) {
+        const TraceEvent &event = events.at(i);
+        if (i > 0)
+            data += ",\n";
+        data += "{\"cat\":\"";
+        data += event.category;
+        data += "\",\"name\":\"";
+        data += event.name;
+        data += "\",\"ph\":\"X\",\"ts\":";
+        data += QByteArray::number(event.start / 1000.0, 'f', 3); // microseconds
+        data += ",\"dur\":";
+        data += QByteArray::number(event.duration / 1000.0, 'f', 3);
+        data += ",\"pid\":";
+        data += pid;
+        data += ",\"tid\":";
+        data += QByteArray::number(quint64(event.thread));
+        data += ",\"args\":{\"id\":";
+        data += QByteArray::number(event.id);
+        if (event.bytes) {
+            data += ",\"bytes\":";
+            data += QByteArray::number(event.bytes);
+        }
+        data += "}}";
+    }
+    data += "],\"displayTimeUnit\":\"ms\"}\n";
+
+    return device->write(data) == data.size();
+}
+
+void QFileCopierTracer::clear()
+{
+    QMutexLocker l(&m_mutex);
+    m_next = 0;
+    m_wrapped = false;
+}
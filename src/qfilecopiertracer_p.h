@@ -0,0 +1,80 @@
+#ifndef QFILECOPIERTRACER_P_H
+#define QFILECOPIERTRACER_P_H
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QMutex>
+#include <QtCore/QVector>
+
+class QIODevice;
+
+struct TraceEvent
+{
+    const char *category;
+    const char *name;
+    qint64 start; // nanoseconds since tracer was created
+    qint64 duration;
+    int id;
+    qint64 bytes;
+    quintptr thread;
+};
+
+class QFileCopierTracer
+{
+public:
+    explicit QFileCopierTracer(int capacity = 65536);
+
+    bool isEnabled() const { return m_enabled; }
+    void setEnabled(bool on);
+
+    int capacity() const;
+    void setCapacity(int capacity);
+
+    qint64 now() const { return m_clock.nsecsElapsed(); }
+    void addEvent(const char *category, const char *name, qint64 start, int id, qint64 bytes);
+
+    bool write(QIODevice *device) const;
+    void clear();
+
+private:
+    volatile bool m_enabled;
+    QElapsedTimer m_clock;
+    mutable QMutex m_mutex;
+    QVector<TraceEvent> m_events; // ring buffer, oldest events are overwritten
+    int m_next;
+    bool m_wrapped;
+};
+
+class TraceScope
+{
+public:
+    TraceScope(QFileCopierTracer *tracer, const char *category, const char *name, int id = -1) :
+        m_tracer(tracer->isEnabled() ? tracer : 0), m_category(category), m_name(name),
+        m_start(0), m_id(id), m_bytes(0)
+    {
+        if (m_tracer)
+            m_start = m_tracer->now();
+    }
+
+    ~TraceScope() { end(); }
+
+    void setId(int id) { m_id = id; }
+    void setBytes(qint64 bytes) { m_bytes = bytes; }
+
+    void end()
+    {
+        if (m_tracer) {
+            m_tracer->addEvent(m_category, m_name, m_start, m_id, m_bytes);
+            m_tracer = 0;
+        }
+    }
+
+private:
+    QFileCopierTracer *m_tracer;
+    const char *m_category;
+    const char *m_name;
+    qint64 m_start;
+    int m_id;
+    qint64 m_bytes;
+};
+
+#endif // QFILECOPIERTRACER_P_H
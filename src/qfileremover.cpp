@@ -0,0 +1,350 @@
+#include "qfileremover_p.h"
+#include "qfilecopier_p.h"
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QMutex>
+#include <QtCore/QRunnable>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+#include <QtCore/QWaitCondition>
+
+#ifdef Q_OS_UNIX
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <sys/syscall.h>
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+#endif
+
+#ifdef Q_OS_UNIX
+
+Q_GLOBAL_STATIC(QThreadPool, removerPool)
+
+/*!
+  \internal
+
+    Pool for removals nobody waits for; it uses fewer threads running at idle priority, so
+    they do not compete with copying and foreground removals.
+*/
+class BackgroundRemoverPool : public QThreadPool
+{
+public:
+    BackgroundRemoverPool() { setMaxThreadCount(qMax(1, QThread::idealThreadCount() / 2)); }
+};
+
+Q_GLOBAL_STATIC(BackgroundRemoverPool, backgroundRemoverPool)
+
+// directories kept open by one removal; deeper ones are removed by the thread which found them
+static const int maxOpenDirs = 256;
+
+class RemoveContext
+{
+public:
+    // one reference is held by the caller, other one by the root directory
+    explicit RemoveContext(const CancelToken *t = 0, bool b = false) :
+        ref(2), errors(0), openDirs(0), token(t), background(b), finished(false) {}
+
+    bool isCanceled() const { return token && token->isCanceled(); }
+    QThreadPool *pool() const { return background ? backgroundRemoverPool() : removerPool(); }
+
+    void finish()
+    {
+        QMutexLocker l(&mutex);
+        finished = true;
+        condition.wakeAll();
+    }
+
+    void wait()
+    {
+        QMutexLocker l(&mutex);
+        while (!finished)
+            condition.wait(&mutex);
+    }
+
+    void release()
+    {
+        if (!ref.deref())
+            delete this;
+    }
+
+    QAtomicInt ref;
+    QAtomicInt errors;
+    QAtomicInt openDirs;
+    const CancelToken *token; // alive while the caller waits, null for background removal
+    bool background;
+
+private:
+    QMutex mutex;
+    QWaitCondition condition;
+    bool finished;
+};
+
+/*!
+  \internal
+
+    Directory being removed; it is opened and removed relative to the descriptor of its
+    parent, which stays open until all subdirectories are removed, so entries are never
+    looked up by a path which could be replaced meanwhile. Path of the root is relative to
+    the current directory.
+*/
+struct RemoveNode
+{
+    RemoveNode(RemoveContext *c, RemoveNode *p, const QByteArray &nativeName) :
+        context(c), parent(p), name(nativeName), dir(0), pending(1) {}
+
+    int parentFd() const { return parent ? ::dirfd(parent->dir) : AT_FDCWD; }
+
+    RemoveContext *context;
+    RemoveNode *parent;
+    QByteArray name;
+    DIR *dir; // open while subdirectories are removed
+    QAtomicInt pending; // own scan and subdirectories not removed yet
+};
+
+/*!
+  \internal
+
+    Removes directories which have no pending work left, going up to the root.
+*/
+static void finishNode(RemoveNode *node)
+{
+    while (node && !node->pending.deref()) {
+        RemoveContext *context = node->context;
+        RemoveNode *parent = node->parent;
+
+        if (node->dir) {
+            ::closedir(node->dir);
+            context->openDirs.deref();
+        }
+        if (::unlinkat(node->parentFd(), node->name.constData(), AT_REMOVEDIR) != 0)
+            context->errors.ref();
+
+        if (!parent) {
+            context->finish();
+            context->release();
+        }
+
+        delete node;
+        node = parent;
+    }
+}
+
+static bool isDirectory(int dirFd, const struct dirent *entry)
+{
+#ifdef _DIRENT_HAVE_D_TYPE
+    if (entry->d_type != DT_UNKNOWN)
+        return entry->d_type == DT_DIR;
+#endif
+    struct stat st;
+    return ::fstatat(dirFd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*!
+  \internal
+
+    Unlinks files of one directory relative to its descriptor and schedules
+    subdirectories as separate tasks, so several directories are processed at once.
+    Once too many directories are open, subdirectories are removed by the same thread.
+    Once removal is canceled, directories not scanned yet are left as they are.
+*/
+class RemoveDirectoryTask : public QRunnable
+{
+public:
+    explicit RemoveDirectoryTask(RemoveNode *node) : m_node(node) {}
+
+    void run();
+
+private:
+    RemoveNode *m_node;
+};
+
+void RemoveDirectoryTask::run()
+{
+    RemoveContext *context = m_node->context;
+    if (context->isCanceled()) {
+        context->errors.ref();
+        finishNode(m_node);
+        return;
+    }
+
+    if (context->background)
+        QThread::currentThread()->setPriority(QThread::IdlePriority);
+
+    int fd = ::openat(m_node->parentFd(), m_node->name.constData(),
+                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    m_node->dir = fd == -1 ? 0 : ::fdopendir(fd);
+    if (!m_node->dir) {
+        if (fd != -1)
+            ::close(fd);
+        context->errors.ref();
+        finishNode(m_node);
+        return;
+    }
+    context->openDirs.ref();
+
+    struct dirent *entry;
+    while ((entry = ::readdir(m_node->dir)) != 0) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+            continue;
+
+        if (isDirectory(fd, entry)) {
+            RemoveNode *child = new RemoveNode(context, m_node, QByteArray(name));
+            m_node->pending.ref();
+            if (context->openDirs < maxOpenDirs) {
+                context->pool()->start(new RemoveDirectoryTask(child));
+            } else {
+                RemoveDirectoryTask task(child);
+                task.run();
+            }
+        } else if (::unlinkat(fd, name, 0) != 0 && errno != ENOENT) {
+            context->errors.ref();
+        }
+    }
+
+    finishNode(m_node);
+}
+
+static RemoveContext *startRemoving(const QByteArray &nativePath, const CancelToken *token = 0,
+                                    bool background = false)
+{
+    RemoveContext *context = new RemoveContext(token, background);
+    context->pool()->start(new RemoveDirectoryTask(new RemoveNode(context, 0, nativePath)));
+    return context;
+}
+
+#else
+
+static bool removePathRecursively(const QString &path, const CancelToken *token = 0)
+{
+    bool result = true;
+    QFileInfo info(path);
+    if (info.isDir() && !info.isSymLink()) {
+        if (token && token->isCanceled())
+            return false;
+        QDir dir(path);
+        foreach (const QString &entry, dir.entryList(QDir::AllDirs | QDir::Files | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot)) {
+            result &= removePathRecursively(dir.absoluteFilePath(entry), token);
+        }
+        if (!info.dir().rmdir(info.fileName()))
+            return false;
+    } else {
+        result = QFile::remove(path);
+    }
+    return result;
+}
+
+#endif
+
+/*!
+  \internal
+
+    Removes file or whole directory tree at \a path and waits until it is removed.
+
+    On Unix, entries are unlinked relative to directory descriptors by a pool of threads,
+    one directory per thread at a time. Symbolic links are removed, never followed.
+    \a token is checked before each directory; canceled removal returns false.
+*/
+bool QFileRemover::removePath(const QString &path, const CancelToken *token)
+{
+#ifdef Q_OS_UNIX
+    QByteArray nativePath = QFile::encodeName(path);
+    struct stat st;
+    if (::lstat(nativePath.constData(), &st) != 0)
+        return false;
+
+    if (!S_ISDIR(st.st_mode))
+        return ::unlink(nativePath.constData()) == 0;
+
+    RemoveContext *context = startRemoving(nativePath, token);
+    context->wait();
+    bool result = context->errors == 0;
+    context->release();
+    return result;
+#else
+    return removePathRecursively(path, token);
+#endif
+}
+
+/*!
+  \internal
+
+    Renames directory at \a path to a hidden sibling and removes it in background, so path is
+    free immediately. Falls back to removePath() if the directory cannot be renamed.
+    Background removals use their own pool of idle priority threads.
+*/
+bool QFileRemover::removePathInBackground(const QString &path)
+{
+#ifdef Q_OS_UNIX
+    QByteArray nativePath = QFile::encodeName(path);
+    struct stat st;
+    if (::lstat(nativePath.constData(), &st) != 0)
+        return false;
+
+    if (!S_ISDIR(st.st_mode))
+        return ::unlink(nativePath.constData()) == 0;
+
+    QByteArray nativeHiddenPath = QFile::encodeName(hiddenPath(path, QLatin1String("removed")));
+    if (::rename(nativePath.constData(), nativeHiddenPath.constData()) != 0)
+        return removePath(path);
+
+    startRemoving(nativeHiddenPath, 0, true)->release();
+    return true;
+#else
+    return removePathRecursively(path);
+#endif
+}
+
+/*!
+  \internal
+
+    Swaps entries at \a path and \a other, so neither path disappears. On Linux it is done
+    atomically by renameat2() with RENAME_EXCHANGE; where it is not available or supported by
+    the file system, \a other is renamed aside first, so it is missing for a moment.
+*/
+bool QFileRemover::exchangePaths(const QString &path, const QString &other)
+{
+#if defined(Q_OS_LINUX) && defined(SYS_renameat2)
+    if (::syscall(SYS_renameat2, AT_FDCWD, QFile::encodeName(path).constData(),
+                  AT_FDCWD, QFile::encodeName(other).constData(), RENAME_EXCHANGE) == 0)
+        return true;
+#endif
+    QDir dir;
+    QString aside = hiddenPath(other, QLatin1String("swap"));
+    if (!dir.rename(other, aside))
+        return false;
+    if (!dir.rename(path, other)) {
+        dir.rename(aside, other);
+        return false;
+    }
+    return dir.rename(aside, path);
+}
+
+/*!
+  \internal
+
+    Returns unique name of hidden sibling of \a path marked with \a tag; used for
+    temporary files and directories being removed.
+*/
+QString QFileRemover::hiddenPath(const QString &path, const QString &tag)
+{
+    static QAtomicInt counter;
+
+    QFileInfo info(path);
+    return info.absolutePath() + QLatin1String("/.") + info.fileName()
+            + QLatin1Char('.') + tag + QLatin1Char('-')
+            + QString::number(QCoreApplication::applicationPid())
+            + QLatin1Char('-') + QString::number(counter.fetchAndAddRelaxed(1));
+}
@@ -0,0 +1,18 @@
+#ifndef QFILEREMOVER_P_H
+#define QFILEREMOVER_P_H
+
+#include <QtCore/QString>
+
+class CancelToken;
+
+class QFileRemover
+{
+public:
+    static bool removePath(const QString &path, const CancelToken *token = 0);
+    static bool removePathInBackground(const QString &path);
+    static bool exchangePaths(const QString &path, const QString &other);
+
+    static QString hiddenPath(const QString &path, const QString &tag);
+};
+
+#endif // QFILEREMOVER_P_H
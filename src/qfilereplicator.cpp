@@ -0,0 +1,286 @@
+#include "qfilereplicator_p.h"
+#include "qfilecopier_p.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QDirIterator>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSocketNotifier>
+
+#ifdef Q_OS_LINUX
+#include <errno.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+static const int flushDelay = 200; // events arriving meanwhile are coalesced
+static const int rescanInterval = 60*1000;
+
+QFileReplicator::QFileReplicator(QFileCopierPrivate *copier, const QString &sourcePath,
+                                 const QString &destinationPath, QFileCopier::CopyFlags flags,
+                                 QObject *parent) :
+    QObject(parent),
+    m_copier(copier),
+    m_source(QDir::cleanPath(QFileInfo(sourcePath).absoluteFilePath())),
+    m_dest(QDir::cleanPath(QFileInfo(destinationPath).absoluteFilePath())),
+    m_flags(flags | QFileCopier::NonInteractive),
+    m_fd(-1),
+    m_notifier(0),
+    m_overflow(false),
+    m_rescanJob(-1)
+{
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(flushDelay);
+    connect(&m_flushTimer, SIGNAL(timeout()), SLOT(flush()));
+
+    m_rescanTimer.setInterval(rescanInterval);
+    connect(&m_rescanTimer, SIGNAL(timeout()), SLOT(rescan()));
+}
+
+QFileReplicator::~QFileReplicator()
+{
+    closeFeed();
+}
+
+/*!
+  \internal
+
+    Subscribes to changes and mirrors the whole tree.
+*/
+void QFileReplicator::start()
+{
+#ifdef Q_OS_LINUX
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd != -1) {
+        m_notifier = new QSocketNotifier(m_fd, QSocketNotifier::Read, this);
+        connect(m_notifier, SIGNAL(activated(int)), SLOT(readEvents()));
+    }
+#endif
+    rescan();
+}
+
+void QFileReplicator::readEvents()
+{
+#ifdef Q_OS_LINUX
+    union {
+        struct inotify_event event;
+        char data[16*1024];
+    } buffer;
+
+    ssize_t length;
+    while ((length = ::read(m_fd, buffer.data, sizeof(buffer))) > 0) {
+        const char *p = buffer.data;
+        while (p < buffer.data + length) {
+            const struct inotify_event *e = reinterpret_cast<const struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + e->len;
+
+            if (e->mask & IN_Q_OVERFLOW) {
+                m_overflow = true;
+                continue;
+            }
+            if (!m_watches.contains(e->wd))
+                continue;
+            if (e->mask & IN_IGNORED) {
+                m_watches.remove(e->wd);
+                continue;
+            }
+            if (e->len == 0)
+                continue;
+
+            QString dir = m_watches.value(e->wd);
+            QString name = QFile::decodeName(e->name);
+            QString path = dir.isEmpty() ? name : dir + QLatin1Char('/') + name;
+            m_changes.insert(path);
+
+            // new directory could be filled before it is watched, it is mirrored as a whole anyway
+            if ((e->mask & IN_ISDIR) && (e->mask & (IN_CREATE | IN_MOVED_TO)) && !addWatches(path))
+                m_overflow = true;
+        }
+    }
+#endif
+
+    // delay is not restarted, so continuous changes are still flushed regularly
+    if (!m_flushTimer.isActive())
+        m_flushTimer.start();
+}
+
+/*!
+  \internal
+
+    Enqueues changed paths as a single job: paths which exist in source are mirrored, other
+    ones are removed from destination. Paths are filtered as they are by mirroring the whole
+    tree with filters of the job: excluded entries and everything inside them are neither
+    copied nor removed, and files which are not included are not copied.
+*/
+void QFileReplicator::flush()
+{
+    if (m_overflow) {
+        m_overflow = false;
+        m_changes.clear();
+        rescan();
+        return;
+    }
+
+    // filters are copied to the job when it is enqueued below
+    FileFilter filter = m_copier->thread->filter();
+
+    QList<Task> tasks;
+    foreach (const QString &path, m_changes) {
+        if (isCovered(path) || isExcluded(path, filter))
+            continue;
+
+        Task t;
+        QFileInfo source(sourcePath(path));
+        if (source.exists() || source.isSymLink()) {
+            if (!filter.isIncluded(source))
+                continue;
+            t.type = Task::Copy;
+            t.source = source.filePath();
+            t.dest = destPath(path);
+            t.copyFlags = m_flags | QFileCopier::Mirror;
+            tasks.append(t);
+            continue;
+        }
+
+        QFileInfo dest(destPath(path));
+        if (!dest.exists() && !dest.isSymLink())
+            continue;
+
+        // removed directory is kept with excluded entries inside, as stale ones are
+        QStringList stale;
+        if (filter.excludes.isEmpty())
+            stale.append(dest.filePath());
+        else
+            addStaleEntry(dest.filePath(), filter, &stale);
+        foreach (const QString &stalePath, stale) {
+            t.type = Task::Remove;
+            t.source = stalePath;
+            t.copyFlags = m_flags & ~(QFileCopier::Mirror | QFileCopier::FollowLinks); // link itself is removed
+            tasks.append(t);
+        }
+    }
+    m_changes.clear();
+
+    if (!tasks.isEmpty())
+        m_copier->enqueueTasks(tasks, true);
+}
+
+/*!
+  \internal
+
+    Watches the whole tree again and mirrors it; falls back to periodic rescans if changes
+    cannot be watched. Mirrors do not overlap: while previous one is pending, periodic rescan
+    is skipped and rescan after overflow is retried with next flush.
+*/
+void QFileReplicator::rescan()
+{
+    if (m_rescanJob != -1 && m_copier->thread->job(m_rescanJob).pending > 0) {
+        if (m_fd != -1) {
+            m_overflow = true;
+            if (!m_flushTimer.isActive())
+                m_flushTimer.start();
+        }
+        return;
+    }
+
+    if (m_fd != -1 && !addWatches(QString()))
+        closeFeed();
+    if (m_fd == -1 && !m_rescanTimer.isActive())
+        m_rescanTimer.start();
+
+    Task t;
+    t.type = Task::Copy;
+    t.source = m_source;
+    t.dest = m_dest;
+    t.copyFlags = m_flags | QFileCopier::Mirror;
+    m_rescanJob = m_copier->enqueueTasks(QList<Task>() << t, true);
+}
+
+/*!
+  \internal
+
+    Watches directory \a path and its subdirectories; directories already watched only get
+    their path updated. Returns false if a watch could not be added, e.g. due to the limit of
+    watches.
+*/
+bool QFileReplicator::addWatches(const QString &path)
+{
+#ifdef Q_OS_LINUX
+    // files are copied once they are closed, IN_MODIFY would copy them while being written
+    static const uint32_t mask = IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM
+            | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+    QString root = sourcePath(path);
+    QStringList dirs(root);
+    QDirIterator it(root, QDir::Dirs | QDir::NoSymLinks | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot,
+                    QDirIterator::Subdirectories);
+    while (it.hasNext())
+        dirs.append(it.next());
+
+    foreach (const QString &dir, dirs) {
+        int wd = inotify_add_watch(m_fd, QFile::encodeName(dir).constData(), mask);
+        if (wd == -1) {
+            if (errno == ENOENT || errno == ENOTDIR) // removed meanwhile, its removal is reported
+                continue;
+            return false;
+        }
+        m_watches.insert(wd, dir.mid(m_source.size() + 1));
+    }
+    return true;
+#else
+    Q_UNUSED(path);
+    return false;
+#endif
+}
+
+void QFileReplicator::closeFeed()
+{
+    delete m_notifier;
+    m_notifier = 0;
+    m_watches.clear();
+#ifdef Q_OS_LINUX
+    if (m_fd != -1)
+        ::close(m_fd);
+#endif
+    m_fd = -1;
+}
+
+/*!
+  \internal
+
+    Returns true if any component of \a path is excluded by \a filter.
+*/
+bool QFileReplicator::isExcluded(const QString &path, const FileFilter &filter)
+{
+    if (filter.excludes.isEmpty())
+        return false;
+
+    foreach (const QString &name, path.split(QLatin1Char('/'), QString::SkipEmptyParts)) {
+        if (filter.isExcluded(name))
+            return true;
+    }
+    return false;
+}
+
+/*!
+  \internal
+
+    Returns true if a parent directory of \a path is changed too; its subtree is mirrored then.
+*/
+bool QFileReplicator::isCovered(const QString &path) const
+{
+    for (int i = path.lastIndexOf(QLatin1Char('/')); i > 0; i = path.lastIndexOf(QLatin1Char('/'), i - 1)) {
+        if (m_changes.contains(path.left(i)))
+            return true;
+    }
+    return false;
+}
+
+QString QFileReplicator::sourcePath(const QString &path) const
+{
+    return path.isEmpty() ? m_source : m_source + QLatin1Char('/') + path;
+}
+
+QString QFileReplicator::destPath(const QString &path) const
+{
+    return path.isEmpty() ? m_dest : m_dest + QLatin1Char('/') + path;
+}
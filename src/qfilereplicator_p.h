@@ -0,0 +1,63 @@
+#ifndef QFILEREPLICATOR_P_H
+#define QFILEREPLICATOR_P_H
+
+#include "qfilecopier.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QObject>
+#include <QtCore/QSet>
+#include <QtCore/QTimer>
+
+class FileFilter;
+class QFileCopierPrivate;
+class QSocketNotifier;
+
+/*!
+  \internal
+
+    Keeps destination replicated to source after initial mirror. On Linux directories of source
+    are watched with inotify and only changed paths are mirrored again; events are coalesced
+    for a short delay, so a burst of changes becomes a single job. Where change feed is not
+    available or its queue overflows, whole tree is mirrored again.
+
+    Lives in the thread of QFileCopier, tasks are enqueued as usual jobs.
+*/
+class QFileReplicator : public QObject
+{
+    Q_OBJECT
+
+public:
+    QFileReplicator(QFileCopierPrivate *copier, const QString &sourcePath, const QString &destinationPath,
+                    QFileCopier::CopyFlags flags, QObject *parent = 0);
+    ~QFileReplicator();
+
+    void start();
+
+private slots:
+    void readEvents();
+    void flush();
+    void rescan();
+
+private:
+    bool addWatches(const QString &path);
+    void closeFeed();
+    static bool isExcluded(const QString &path, const FileFilter &filter);
+    bool isCovered(const QString &path) const;
+    QString sourcePath(const QString &path) const;
+    QString destPath(const QString &path) const;
+
+    QFileCopierPrivate *m_copier;
+    QString m_source;
+    QString m_dest;
+    QFileCopier::CopyFlags m_flags;
+    int m_fd;
+    QSocketNotifier *m_notifier;
+    QHash<int, QString> m_watches; // watch descriptors of directories, relative to source
+    QSet<QString> m_changes; // changed paths relative to source, empty path is the root
+    bool m_overflow;
+    int m_rescanJob; // last whole tree mirror, its id could be reused once it is finished
+    QTimer m_flushTimer;
+    QTimer m_rescanTimer; // used when changes cannot be watched
+};
+
+#endif // QFILEREPLICATOR_P_H
@@ -0,0 +1,130 @@
+#include "qfilecopier_p.h"
+#include "qfilebufferpool_p.h"
+
+#include <QtCore/QRunnable>
+#include <QtCore/QThreadPool>
+
+#include <string.h>
+
+class VerifyRunnable : public QRunnable
+{
+public:
+    VerifyRunnable(QFileVerifier *verifier, const PoolBuffer &buffer) :
+        m_verifier(verifier), m_buffer(buffer) {}
+
+    void run() { m_verifier->work(m_buffer.data, m_buffer.size); }
+
+private:
+    QFileVerifier *m_verifier;
+    PoolBuffer m_buffer;
+};
+
+QFileVerifier::QFileVerifier(const CancelTokenPointer &token) :
+    m_token(token)
+{
+}
+
+void QFileVerifier::addFile(int id, const QString &source, const QString &dest, bool followLinks)
+{
+    Entry entry;
+    entry.id = id;
+    entry.source = source;
+    entry.dest = dest;
+    entry.followLinks = followLinks;
+    m_files.append(entry);
+}
+
+/*!
+  \internal
+
+    Compares all added files using up to \a threadCount threads and returns ids of files
+    which differ. Nothing is reported once the token is canceled.
+
+    Buffers are borrowed from the pool by the calling thread, so verification shares its
+    memory limit: the first one may wait for it, the others are taken only if they are free,
+    so fewer threads are used under memory pressure. Each thread compares files using halves
+    of one buffer. All files are reported if no buffer can be allocated.
+*/
+QList<int> QFileVerifier::run(int threadCount)
+{
+    m_equal = QVector<char>(m_files.size(), 1);
+    m_next = 0;
+
+    PooledBuffer buffer;
+    if (!buffer.data()) {
+        m_equal.fill(0);
+    } else {
+        QList<PoolBuffer> buffers;
+        for (int i = 1; i < qMin(threadCount, m_files.size()); i++) {
+            PoolBuffer extra = QFileBufferPool::instance()->tryAcquire();
+            if (!extra.data)
+                break;
+            buffers.append(extra);
+        }
+
+        QThreadPool pool;
+        pool.setMaxThreadCount(buffers.size() + 1);
+        PoolBuffer first;
+        first.data = buffer.data();
+        first.size = buffer.size();
+        pool.start(new VerifyRunnable(this, first));
+        foreach (const PoolBuffer &extra, buffers)
+            pool.start(new VerifyRunnable(this, extra));
+        pool.waitForDone();
+
+        foreach (const PoolBuffer &extra, buffers)
+            QFileBufferPool::instance()->release(extra);
+    }
+
+    QList<int> result;
+    if (m_token->isCanceled())
+        return result;
+    for (int i = 0; i < m_files.size(); i++) {
+        if (!m_equal.at(i))
+            result.append(m_files.at(i).id);
+    }
+    return result;
+}
+
+void QFileVerifier::work(char *buffer, int size)
+{
+    int blockSize = size / 2;
+
+    int index;
+    while ((index = m_next.fetchAndAddRelaxed(1)) < m_files.size() && !m_token->isCanceled())
+        m_equal[index] = compare(m_files.at(index), buffer, buffer + blockSize, blockSize);
+}
+
+/*!
+  \internal
+
+    Reads both files block by block and compares blocks directly; unlike hashing, a mismatch
+    is found at the first differing block. Symbolic links copied as links are not followed:
+    they are equal if both are links to the same target.
+*/
+bool QFileVerifier::compare(const Entry &entry, char *sourceBuffer, char *destBuffer, int blockSize) const
+{
+    QFileInfo sourceInfo(entry.source);
+    QFileInfo destInfo(entry.dest);
+    if (sourceInfo.isSymLink() && !entry.followLinks)
+        return destInfo.isSymLink() && sourceInfo.symLinkTarget() == destInfo.symLinkTarget();
+    if (!sourceInfo.exists() || !destInfo.exists() || sourceInfo.size() != destInfo.size())
+        return false;
+
+    QFile sourceFile(entry.source);
+    QFile destFile(entry.dest);
+    if (!sourceFile.open(QFile::ReadOnly | QFile::Unbuffered) || !destFile.open(QFile::ReadOnly | QFile::Unbuffered))
+        return false;
+
+    forever {
+        if (m_token->isCanceled())
+            return true;
+
+        qint64 sourceLength = sourceFile.read(sourceBuffer, blockSize);
+        qint64 destLength = destFile.read(destBuffer, blockSize);
+        if (sourceLength < 0 || sourceLength != destLength || memcmp(sourceBuffer, destBuffer, sourceLength) != 0)
+            return false;
+        if (sourceLength == 0)
+            return true;
+    }
+}
@@ -0,0 +1,231 @@
+#include "qtarwriter_p.h"
+
+#include <QtCore/QDateTime>
+#include <QtCore/QFileInfo>
+
+#include <string.h>
+
+static const int blockSize = 512;
+static const qint64 maxOctalSize = Q_INT64_C(077777777777); // 11 octal digits of ustar size field
+
+enum EntryType {
+    FileType = '0',
+    SymLinkType = '2',
+    DirType = '5',
+    PaxHeaderType = 'x'
+};
+
+static qint64 paddingSize(qint64 size)
+{
+    return (blockSize - size % blockSize) % blockSize;
+}
+
+/*!
+  \internal
+
+    Writes \a value as length - 1 octal digits followed by NUL; writes zero if it does not fit.
+*/
+static void setOctal(char *field, int length, quint64 value)
+{
+    if (value >> (3 * (length - 1)))
+        value = 0;
+    field[length - 1] = 0;
+    for (int i = length - 2; i >= 0; i--) {
+        field[i] = char('0' + (value & 7));
+        value >>= 3;
+    }
+}
+
+static void setField(char *field, int length, const QByteArray &value)
+{
+    memcpy(field, value.constData(), qMin(length, value.size()));
+}
+
+static int unixMode(QFile::Permissions permissions)
+{
+    static const QFile::Permission bits[] = {
+        QFile::ReadOwner, QFile::WriteOwner, QFile::ExeOwner,
+        QFile::ReadGroup, QFile::WriteGroup, QFile::ExeGroup,
+        QFile::ReadOther, QFile::WriteOther, QFile::ExeOther
+    };
+
+    int mode = 0;
+    for (int i = 0; i < 9; i++) {
+        if (permissions & bits[i])
+            mode |= 0400 >> i;
+    }
+    return mode;
+}
+
+static void fillHeader(char *header, const QByteArray &path, char type, qint64 size,
+                       const QFileInfo &info, const QByteArray &linkTarget)
+{
+    memset(header, 0, blockSize);
+    setField(header, 100, path);
+    setOctal(header + 100, 8, unixMode(info.permissions()));
+    setOctal(header + 108, 8, info.ownerId());
+    setOctal(header + 116, 8, info.groupId());
+    setOctal(header + 124, 12, size);
+    setOctal(header + 136, 12, info.lastModified().toTime_t());
+    header[156] = type;
+    setField(header + 157, 100, linkTarget);
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    // checksum is computed with its own field filled with spaces
+    memset(header + 148, ' ', 8);
+    quint32 checksum = 0;
+    for (int i = 0; i < blockSize; i++)
+        checksum += uchar(header[i]);
+    setOctal(header + 148, 7, checksum);
+}
+
+/*!
+  \internal
+
+    Returns pax extended header record; its length includes digits of the length itself.
+*/
+static QByteArray paxRecord(const char *key, const QByteArray &value)
+{
+    QByteArray record = QByteArray(" ") + key + '=' + value + '\n';
+    int length = record.size() + 1;
+    while (QByteArray::number(length).size() + record.size() != length)
+        length++;
+    return QByteArray::number(length) + record;
+}
+
+QTarWriter::QTarWriter(const QString &fileName) :
+    m_file(fileName),
+    m_entryStart(0),
+    m_dataEnd(0),
+    m_broken(false)
+{
+}
+
+QTarWriter::~QTarWriter()
+{
+    close();
+}
+
+/*!
+  \internal
+
+    Creates the archive; existing file is replaced.
+*/
+bool QTarWriter::open()
+{
+    m_entryStart = 0;
+    m_dataEnd = 0;
+    m_broken = false;
+    return m_file.open(QFile::WriteOnly | QFile::Truncate);
+}
+
+/*!
+  \internal
+
+    Writes end of archive and closes it. Returns false if the archive could not be completed.
+*/
+bool QTarWriter::close()
+{
+    if (!m_file.isOpen())
+        return true;
+
+    bool result = writePadding(2 * blockSize) && m_file.flush() && !m_broken;
+    m_file.close();
+    return result;
+}
+
+bool QTarWriter::writeDirectory(const QString &name, const QFileInfo &info)
+{
+    return writeHeader(name, DirType, 0, info);
+}
+
+bool QTarWriter::writeSymLink(const QString &name, const QString &target, const QFileInfo &info)
+{
+    return writeHeader(name, SymLinkType, 0, info, target);
+}
+
+/*!
+  \internal
+
+    Writes header of a file of \a size bytes; exactly \a size bytes of data should be written
+    to device() then.
+*/
+bool QTarWriter::beginFile(const QString &name, qint64 size, const QFileInfo &info)
+{
+    if (!writeHeader(name, FileType, size, info))
+        return false;
+
+    m_dataEnd = m_file.pos() + size;
+    return true;
+}
+
+/*!
+  \internal
+
+    Pads data of current file with zeros if less data than declared was written.
+*/
+bool QTarWriter::endFile()
+{
+    return writePadding(m_dataEnd - m_file.pos()) && writePadding(paddingSize(m_file.pos()));
+}
+
+/*!
+  \internal
+
+    Drops partially written entry, so it can be written again or skipped.
+*/
+void QTarWriter::abortEntry()
+{
+    if (!m_file.flush() || !m_file.resize(m_entryStart) || !m_file.seek(m_entryStart))
+        m_broken = true;
+}
+
+bool QTarWriter::writeHeader(const QString &name, char type, qint64 size, const QFileInfo &info,
+                             const QString &linkTarget)
+{
+    if (m_broken)
+        return false;
+
+    m_entryStart = m_file.pos();
+
+    QByteArray path = name.toUtf8();
+    if (type == DirType)
+        path += '/';
+    QByteArray link = linkTarget.toUtf8();
+
+    // long names and huge sizes are stored in pax extended header preceding the entry
+    QByteArray records;
+    if (path.size() > 100)
+        records += paxRecord("path", path);
+    if (link.size() > 100)
+        records += paxRecord("linkpath", link);
+    if (size > maxOctalSize)
+        records += paxRecord("size", QByteArray::number(size));
+
+    char header[blockSize];
+    if (!records.isEmpty()) {
+        fillHeader(header, "././@PaxHeader", PaxHeaderType, records.size(), info, QByteArray());
+        if (m_file.write(header, blockSize) != blockSize
+                || m_file.write(records) != records.size()
+                || !writePadding(paddingSize(records.size()))) {
+            return false;
+        }
+    }
+
+    fillHeader(header, path.left(100), type, size > maxOctalSize ? 0 : size, info, link.left(100));
+    return m_file.write(header, blockSize) == blockSize;
+}
+
+bool QTarWriter::writePadding(qint64 size)
+{
+    static const char zeros[blockSize] = { 0 };
+
+    while (size > 0) {
+        qint64 length = qMin(size, qint64(blockSize));
+        if (m_file.write(zeros, length) != length)
+            return false;
+        size -= length;
+    }
+    return true;
+}
@@ -0,0 +1,46 @@
+#ifndef QTARWRITER_P_H
+#define QTARWRITER_P_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QFile>
+#include <QtCore/QString>
+
+class QFileInfo;
+
+/*!
+  \internal
+
+    Writes entries to a tar archive in POSIX pax format, so the whole tree is written to a single
+    file sequentially. Data of a file is written to device() between beginFile() and endFile().
+*/
+class QTarWriter
+{
+public:
+    explicit QTarWriter(const QString &fileName);
+    ~QTarWriter();
+
+    QString fileName() const { return m_file.fileName(); }
+    bool isOpen() const { return m_file.isOpen(); }
+    bool open();
+    bool close();
+
+    QIODevice *device() { return &m_file; }
+
+    bool writeDirectory(const QString &name, const QFileInfo &info);
+    bool writeSymLink(const QString &name, const QString &target, const QFileInfo &info);
+    bool beginFile(const QString &name, qint64 size, const QFileInfo &info);
+    bool endFile();
+    void abortEntry();
+
+private:
+    bool writeHeader(const QString &name, char type, qint64 size, const QFileInfo &info,
+                     const QString &linkTarget = QString());
+    bool writePadding(qint64 size);
+
+    QFile m_file;
+    qint64 m_entryStart;
+    qint64 m_dataEnd; // where data of current file should end
+    bool m_broken; // entry could not be dropped, archive can only be closed
+};
+
+#endif // QTARWRITER_P_H
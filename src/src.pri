@@ -3,8 +3,20 @@ QT *= core
 
 DEPENDPATH  *= $$PWD
 
-SOURCES += qfilecopier.cpp
+SOURCES += qfilecopier.cpp \
+    qfilebufferpool.cpp \
+    qfilecopierstore.cpp \
+    qfilecopiertracer.cpp \
+    qfileremover.cpp \
+    qfilereplicator.cpp \
+    qfileverifier.cpp \
+    qtarwriter.cpp
 
 HEADERS += qfilecopier.h\
         qfilecopier_global.h \
-    ../src/qfilecopier_p.h
+    ../src/qfilebufferpool_p.h \
+    ../src/qfilecopier_p.h \
+    ../src/qfilecopiertracer_p.h \
+    ../src/qfileremover_p.h \
+    ../src/qfilereplicator_p.h \
+    ../src/qtarwriter_p.h
@@ -0,0 +1,14 @@
+QT       += testlib
+
+QT       -= gui
+
+TARGET = tst_qfilecopierbench
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += -I $$OUT_PWD -I $$PWD/../../src/
+LIBS += -L$$OUT_PWD/../../lib -lqfilecopier
+
+SOURCES += tst_qfilecopierbench.cpp
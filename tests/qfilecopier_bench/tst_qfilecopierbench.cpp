@@ -0,0 +1,307 @@
+#include <QtCore/QString>
+#include <QtTest/QtTest>
+#include <QtCore/QCoreApplication>
+#include <QtCore/qmath.h>
+
+#include <QFileCopier>
+
+/*
+    Benchmarks of the copy engine on generated trees:
+
+    tiny    1000000 * scale files of 64 bytes, 1000 files per directory
+    deep    256 nested directories with a small file on each level
+    huge    4 files of 1 Gb * scale
+    sparse  2 files of 1 Gb * scale with only a few blocks written
+    mixed   10000 * scale files of log-uniformly distributed sizes up to 16 Mb
+
+    Scale is read from QFILECOPIER_BENCH_SCALE (default 0.01), trees are created in
+    QFILECOPIER_BENCH_DIR (default is temporary directory), so device under test can be chosen.
+    Contents depend only on the scale. Use -xml or -xunitxml to get machine-readable results.
+*/
+
+static const int tinyFileSize = 64;
+
+static bool removePath(const QString &path)
+{
+    bool result = true;
+    QFileInfo info(path);
+    if (info.isDir() && !info.isSymLink()) {
+        QDir dir(path);
+        foreach (const QString &entry, dir.entryList(QDir::AllEntries | QDir::System | QDir::Hidden | QDir::NoDotAndDotDot)) {
+            result &= removePath(dir.absoluteFilePath(entry));
+        }
+        if (!info.dir().rmdir(info.fileName()))
+            return false;
+    } else {
+        result = QFile::remove(path);
+    }
+    return result;
+}
+
+class QFileCopierBench : public QObject
+{
+    Q_OBJECT
+
+public:
+    QFileCopierBench();
+
+private Q_SLOTS:
+    void initTestCase();
+    void cleanupTestCase();
+    void cleanup();
+    void copy_data();
+    void copy();
+    void move_data();
+    void move();
+    void remove_data();
+    void remove();
+    void link_data();
+    void link();
+
+private:
+    void addTrees();
+    void createTiny(const QString &folder);
+    void createDeep(const QString &folder);
+    void createHuge(const QString &folder);
+    void createSparse(const QString &folder);
+    void createMixed(const QString &folder);
+    void createFile(const QString &path, qint64 size);
+    QString source(const QString &tree) const;
+
+private:
+    QString benchFolder;
+    QString destFolder;
+    double scale;
+    QFileCopier copier;
+};
+
+QFileCopierBench::QFileCopierBench() :
+    scale(0.01)
+{
+}
+
+void QFileCopierBench::initTestCase()
+{
+    QByteArray scaleValue = qgetenv("QFILECOPIER_BENCH_SCALE");
+    if (!scaleValue.isEmpty())
+        scale = scaleValue.toDouble();
+    QVERIFY2(scale > 0, "Invalid QFILECOPIER_BENCH_SCALE");
+
+    QString folder = QString::fromLocal8Bit(qgetenv("QFILECOPIER_BENCH_DIR"));
+    if (folder.isEmpty())
+        folder = QDir::tempPath();
+    benchFolder = folder + "/qfilecopier_bench";
+    destFolder = benchFolder + "/dest";
+
+    removePath(benchFolder);
+    QVERIFY2(QDir().mkpath(benchFolder), "Cannot create bench folder");
+
+    qsrand(42); // same trees on each run
+    createTiny(source("tiny"));
+    createDeep(source("deep"));
+    createHuge(source("huge"));
+    createSparse(source("sparse"));
+    createMixed(source("mixed"));
+}
+
+void QFileCopierBench::cleanupTestCase()
+{
+    removePath(benchFolder);
+}
+
+void QFileCopierBench::cleanup()
+{
+    removePath(destFolder);
+}
+
+void QFileCopierBench::copy_data()
+{
+    addTrees();
+}
+
+void QFileCopierBench::copy()
+{
+    QFETCH(QString, tree);
+
+    QBENCHMARK_ONCE {
+        copier.copy(source(tree), destFolder);
+        copier.waitForFinished();
+    }
+
+    QVERIFY2(QFileInfo(destFolder).isDir(), "Files were not copied");
+}
+
+void QFileCopierBench::move_data()
+{
+    QTest::addColumn<QString>("tree");
+    QTest::addColumn<bool>("copyOnMove");
+
+    QStringList trees;
+    trees << "tiny" << "deep" << "huge" << "sparse" << "mixed";
+    foreach (const QString &tree, trees) {
+        QTest::newRow(qPrintable(tree + "-rename")) << tree << false;
+        QTest::newRow(qPrintable(tree + "-copy")) << tree << true;
+    }
+}
+
+void QFileCopierBench::move()
+{
+    QFETCH(QString, tree);
+    QFETCH(bool, copyOnMove);
+
+    QFileCopier::CopyFlags flags = copyOnMove ? QFileCopier::CopyOnMove : QFileCopier::CopyFlags(0);
+    QBENCHMARK_ONCE {
+        copier.move(source(tree), destFolder, flags);
+        copier.waitForFinished();
+    }
+
+    // restore source for next rows
+    copier.move(destFolder, source(tree));
+    copier.waitForFinished();
+
+    QVERIFY2(QFileInfo(source(tree)).isDir() && !QFileInfo(destFolder).exists(), "Files were not moved");
+}
+
+void QFileCopierBench::remove_data()
+{
+    QTest::addColumn<QString>("tree");
+    QTest::addColumn<bool>("background");
+
+    QStringList trees;
+    trees << "tiny" << "deep" << "mixed";
+    foreach (const QString &tree, trees) {
+        QTest::newRow(qPrintable(tree)) << tree << false;
+        QTest::newRow(qPrintable(tree + "-background")) << tree << true;
+    }
+}
+
+void QFileCopierBench::remove()
+{
+    QFETCH(QString, tree);
+    QFETCH(bool, background);
+
+    copier.hardLink(source(tree), destFolder);
+    copier.waitForFinished();
+
+    QFileCopier::CopyFlags flags = background ? QFileCopier::RemoveInBackground : QFileCopier::CopyFlags(0);
+    QBENCHMARK_ONCE {
+        copier.remove(destFolder, flags);
+        copier.waitForFinished();
+    }
+
+    QVERIFY2(!QFileInfo(destFolder).exists(), "Files were not removed");
+}
+
+void QFileCopierBench::link_data()
+{
+    QTest::addColumn<QString>("tree");
+    QTest::addColumn<bool>("hard");
+
+    QStringList trees;
+    trees << "tiny" << "deep" << "mixed";
+    foreach (const QString &tree, trees) {
+        QTest::newRow(qPrintable(tree + "-symbolic")) << tree << false;
+        QTest::newRow(qPrintable(tree + "-hard")) << tree << true;
+    }
+}
+
+void QFileCopierBench::link()
+{
+    QFETCH(QString, tree);
+    QFETCH(bool, hard);
+
+    QBENCHMARK_ONCE {
+        if (hard)
+            copier.hardLink(source(tree), destFolder);
+        else
+            copier.link(source(tree), destFolder);
+        copier.waitForFinished();
+    }
+
+    QVERIFY2(QFileInfo(destFolder).exists(), "Files were not linked");
+}
+
+void QFileCopierBench::addTrees()
+{
+    QTest::addColumn<QString>("tree");
+
+    QTest::newRow("tiny") << "tiny";
+    QTest::newRow("deep") << "deep";
+    QTest::newRow("huge") << "huge";
+    QTest::newRow("sparse") << "sparse";
+    QTest::newRow("mixed") << "mixed";
+}
+
+void QFileCopierBench::createTiny(const QString &folder)
+{
+    int count = qMax(1, int(1000000 * scale));
+    for (int i = 0; i < count; i++) {
+        QString dir = folder + QString("/%1").arg(i / 1000, 4, 10, QLatin1Char('0'));
+        if (i % 1000 == 0)
+            QVERIFY2(QDir().mkpath(dir), "Cannot create dir");
+        createFile(dir + QString("/%1.bin").arg(i), tinyFileSize);
+    }
+}
+
+void QFileCopierBench::createDeep(const QString &folder)
+{
+    QString dir = folder;
+    for (int level = 0; level < 256; level++) {
+        dir += QString("/d%1").arg(level);
+        QVERIFY2(QDir().mkpath(dir), "Cannot create dir");
+        createFile(dir + "/file.bin", 4*1024);
+    }
+}
+
+void QFileCopierBench::createHuge(const QString &folder)
+{
+    QVERIFY2(QDir().mkpath(folder), "Cannot create dir");
+    qint64 size = qMax(Q_INT64_C(1024*1024), qint64(Q_INT64_C(1024*1024*1024) * scale));
+    for (int i = 0; i < 4; i++)
+        createFile(folder + QString("/huge%1.bin").arg(i), size);
+}
+
+void QFileCopierBench::createSparse(const QString &folder)
+{
+    QVERIFY2(QDir().mkpath(folder), "Cannot create dir");
+    qint64 size = qMax(Q_INT64_C(1024*1024), qint64(Q_INT64_C(1024*1024*1024) * scale));
+    QByteArray block(4*1024, (char)0xfe);
+    for (int i = 0; i < 2; i++) {
+        QFile f(folder + QString("/sparse%1.bin").arg(i));
+        QVERIFY2(f.open(QFile::WriteOnly), "Can't open file");
+        for (int j = 0; j < 16; j++) {
+            QVERIFY(f.seek(size / 16 * j));
+            f.write(block);
+        }
+        QVERIFY(f.resize(size));
+    }
+}
+
+void QFileCopierBench::createMixed(const QString &folder)
+{
+    QVERIFY2(QDir().mkpath(folder), "Cannot create dir");
+    int count = qMax(1, int(10000 * scale));
+    for (int i = 0; i < count; i++) {
+        // log-uniform sizes from 1 byte to 16 Mb
+        qint64 size = qint64(qPow(2.0, 24.0 * qrand() / RAND_MAX));
+        createFile(folder + QString("/%1.bin").arg(i), size);
+    }
+}
+
+void QFileCopierBench::createFile(const QString &path, qint64 size)
+{
+    QFile f(path);
+    QVERIFY2(f.open(QFile::WriteOnly), "Can't open file");
+    QByteArray arr(64*1024, (char)0xfe);
+    for (qint64 written = 0; written < size; written += arr.size())
+        f.write(arr.constData(), qMin(qint64(arr.size()), size - written));
+}
+
+QString QFileCopierBench::source(const QString &tree) const
+{
+    return benchFolder + QLatin1Char('/') + tree;
+}
+
+QTEST_MAIN(QFileCopierBench)
+
+#include "tst_qfilecopierbench.moc"
@@ -1,9 +1,15 @@
 #include <QtCore/QString>
 #include <QtTest/QtTest>
+#include <QtCore/QBuffer>
 #include <QtCore/QCoreApplication>
 
 #include <QFileCopier>
 
+#ifdef Q_OS_UNIX
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 bool removePath(const QString &path)
 {
     bool result = true;
@@ -35,17 +41,42 @@ private Q_SLOTS:
     void testCopy1();
     void testCopy2();
     void testCopy3();
+    void testCopy4();
     void testRemove();
+    void testRemoveInBackground();
     void testMove1();
     void testMove2();
+    void testMove3();
     void testLink1();
     void testLink2();
+    void testHardLink();
+    void testPreserveHardLinks();
+    void testDeduplicate();
+    void testJobs();
+    void testStatistics();
+    void testTrace();
+    void testLatencies();
+    void testProgressSnapshot();
+    void testEstimate();
+    void testScratchDirectory();
+    void testBufferPool();
+    void testManifest();
+    void testList();
+    void testArchive();
+    void testFilters();
+    void testMirror();
+    void testWatch();
+    void testVerify();
+    void testPriority();
+    void testPriority2();
+    void testCancelSubtree();
 
 private:
     void createFiles(const QString &folder, int mb = 100);
     bool exists(const QString &folder);
     bool exists(const QString &folder, const QStringList &list);
     bool checkFiles(const QString &folder, int expectedSize = 100);
+    int childRequest(int id, const QString &name);
 
 private:
     QString sourceFolder;
@@ -115,6 +146,25 @@ void QFileCopierTest::testCopy3()
     QVERIFY2(checkFiles(destFolder, 100), "Files were not copied");
 }
 
+void QFileCopierTest::testCopy4()
+{
+    createFiles(destFolder, 3);
+    QStringList list;
+
+    QDir dir(sourceFolder);
+    foreach (const QString &file, dir.entryList(QDir::AllEntries | QDir::NoDotAndDotDot)) {
+        list.append(dir.absoluteFilePath(file));
+    }
+
+    copier.copy(list, destFolder, QFileCopier::Force | QFileCopier::AtomicOverwrite);
+    copier.waitForFinished();
+
+    QVERIFY2(checkFiles(destFolder, 100), "Files were not replaced");
+    QVERIFY2(QDir(destFolder).entryList(QStringList() << QLatin1String(".*.part-*"),
+                                        QDir::Hidden | QDir::AllEntries).isEmpty(),
+             "Temporary entries were left");
+}
+
 void QFileCopierTest::testRemove()
 {
     createFiles(destFolder);
@@ -125,6 +175,16 @@ void QFileCopierTest::testRemove()
     QVERIFY2(!exists(destFolder), "Files were not removed");
 }
 
+void QFileCopierTest::testRemoveInBackground()
+{
+    createFiles(destFolder, 1);
+
+    copier.remove(destFolder, QFileCopier::RemoveInBackground);
+    copier.waitForFinished();
+
+    QVERIFY2(!QFileInfo(destFolder).exists(), "Files were not removed");
+}
+
 void QFileCopierTest::testMove1()
 {
     copier.move(sourceFolder, destFolder);
@@ -144,6 +204,22 @@ void QFileCopierTest::testMove2()
     createFiles(sourceFolder);
 }
 
+void QFileCopierTest::testMove3()
+{
+    // on the same device the tree is renamed as a whole, so its entries are not gathered
+    int job = copier.move(sourceFolder, destFolder);
+    copier.waitForFinished();
+
+    QVERIFY2(exists(destFolder) && !exists(sourceFolder), "Files were not moved");
+    QVERIFY2(copier.entryList(copier.jobRequests(job).first()).isEmpty(), "Folder was not renamed");
+
+    job = copier.move(destFolder, sourceFolder, QFileCopier::CopyOnMove);
+    copier.waitForFinished();
+
+    QVERIFY2(exists(sourceFolder) && checkFiles(sourceFolder, 100) && !exists(destFolder), "Files were not moved back");
+    QCOMPARE(copier.entryList(copier.jobRequests(job).first()).size(), QDir(sourceFolder).entryList(QDir::AllEntries | QDir::NoDotAndDotDot).size());
+}
+
 void QFileCopierTest::testLink1()
 {
     copier.link(sourceFolder, destFolder);
@@ -162,6 +238,611 @@ void QFileCopierTest::testLink2()
     QVERIFY2(destInfo.exists() && destInfo.isSymLink() && destInfo.symLinkTarget() == QFileInfo(sourceFolder).absoluteFilePath(), "Folder were not linked");
 }
 
+void QFileCopierTest::testHardLink()
+{
+    int job = copier.hardLink(sourceFolder, destFolder);
+    copier.waitForFinished();
+
+    QVERIFY2(exists(destFolder) && checkFiles(destFolder, 100), "Files were not linked");
+    QCOMPARE(copier.jobSize(job), qint64(1 + dirs.size() + files.size()));
+}
+
+void QFileCopierTest::testPreserveHardLinks()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("Hard links are only checked on Unix", SkipAll);
+#else
+    QString linkPath = sourceFolder + "/folder2/linked.bin";
+    QVERIFY(::link(QFile::encodeName(sourceFolder + "/file1.bin").constData(), QFile::encodeName(linkPath).constData()) == 0);
+
+    // both jobs are queued at once, so links gathered by one must not leak into the other
+    QDir().mkpath(destFolder);
+    copier.copy(sourceFolder, destFolder + "/copy1", QFileCopier::PreserveHardLinks);
+    copier.copy(sourceFolder, destFolder + "/copy2", QFileCopier::PreserveHardLinks);
+    copier.waitForFinished();
+    QFile::remove(linkPath);
+
+    struct stat file1, linked1, file2, linked2;
+    QVERIFY(::stat(QFile::encodeName(destFolder + "/copy1/file1.bin").constData(), &file1) == 0);
+    QVERIFY(::stat(QFile::encodeName(destFolder + "/copy1/folder2/linked.bin").constData(), &linked1) == 0);
+    QVERIFY(::stat(QFile::encodeName(destFolder + "/copy2/file1.bin").constData(), &file2) == 0);
+    QVERIFY(::stat(QFile::encodeName(destFolder + "/copy2/folder2/linked.bin").constData(), &linked2) == 0);
+    QVERIFY2(file1.st_ino == linked1.st_ino && file2.st_ino == linked2.st_ino, "Hard links were not preserved");
+    QVERIFY2(file1.st_ino != file2.st_ino, "Files were linked to another job");
+#endif
+}
+
+void QFileCopierTest::testDeduplicate()
+{
+    // all source files have equal contents
+    copier.resetStatistics();
+    copier.copy(sourceFolder, destFolder, QFileCopier::Deduplicate);
+    copier.waitForFinished();
+
+    QVERIFY2(exists(destFolder) && checkFiles(destFolder, 100), "Files were not copied");
+    QCOMPARE(copier.duplicateGroups(), 1);
+    QCOMPARE(copier.duplicateFiles(), files.size() - 1);
+    QCOMPARE(copier.deduplicatedSize(), qint64(files.size() - 1)*100*1024*1024);
+}
+
+void QFileCopierTest::testJobs()
+{
+    QDir().mkpath(destFolder);
+    int job1 = copier.copy(sourceFolder + "/file1.bin", destFolder);
+    int job2 = copier.copy(sourceFolder + "/folder1", destFolder);
+    copier.setJobPriority(job2, 1);
+    copier.waitForFinished();
+
+    QVERIFY2(job1 != job2, "Jobs have equal ids");
+    QCOMPARE(copier.jobPriority(job2), 1);
+    QCOMPARE(copier.jobRequests(job1).size(), 1);
+    QCOMPARE(copier.jobId(copier.jobRequests(job2).first()), job2);
+    QCOMPARE(copier.jobSize(job1), qint64(100*1024*1024));
+    QCOMPARE(copier.jobProgress(job2), copier.jobSize(job2));
+    QVERIFY2(QFileInfo(destFolder + "/file1.bin").exists() && exists(destFolder + "/folder1", QStringList() << "file11.bin"), "Files were not copied");
+}
+
+void QFileCopierTest::testStatistics()
+{
+    copier.resetStatistics();
+    copier.setStatisticsEnabled(true);
+    int job = copier.copy(sourceFolder + "/file1.bin", destFolder);
+    copier.waitForFinished();
+    copier.setStatisticsEnabled(false);
+
+    int id = copier.jobRequests(job).first();
+    QCOMPARE(copier.phaseBytes(QFileCopier::WritePhase), qint64(100*1024*1024));
+    QCOMPARE(copier.phaseCalls(QFileCopier::OpenPhase), 2);
+    QCOMPARE(copier.requestBytes(id), qint64(100*1024*1024));
+    QVERIFY(copier.requestTime(id, QFileCopier::ReadPhase) > 0);
+    QVERIFY(copier.requestThroughput(id) > 0);
+}
+
+void QFileCopierTest::testTrace()
+{
+    copier.setTraceBufferSize(1024);
+    copier.setTracingEnabled(true);
+    copier.copy(sourceFolder + "/file1.bin", destFolder);
+    copier.waitForFinished();
+    copier.setTracingEnabled(false);
+
+    QBuffer buffer;
+    buffer.open(QBuffer::WriteOnly);
+    QVERIFY(copier.writeTrace(&buffer));
+    QVERIFY(buffer.data().startsWith("{\"traceEvents\":["));
+    QVERIFY(buffer.data().contains("\"name\":\"write\""));
+    QVERIFY(buffer.data().count("\"ph\":\"X\"") <= 1024);
+}
+
+void QFileCopierTest::testLatencies()
+{
+    copier.resetLatencies();
+    copier.setStatisticsEnabled(true);
+    copier.copy(sourceFolder, destFolder);
+    copier.waitForFinished();
+    copier.setStatisticsEnabled(false);
+
+    int sizeClass = QFileCopier::sizeClass(100*1024*1024);
+    QCOMPARE(copier.latencyCount(QFileCopier::CopyLatency), qint64(files.size()));
+    QCOMPARE(copier.latencyCount(QFileCopier::CopyLatency, sizeClass), qint64(files.size()));
+    QVERIFY(copier.latencyPercentile(QFileCopier::CopyLatency, 50) <= copier.latencyPercentile(QFileCopier::CopyLatency, 99));
+    QVERIFY(copier.latencyPercentile(QFileCopier::CopyLatency, 99) <= copier.maxLatency(QFileCopier::CopyLatency));
+    QVERIFY(copier.latencyCount(QFileCopier::OpenLatency) > 0);
+
+    copier.resetLatencies();
+    QCOMPARE(copier.latencyCount(QFileCopier::StatLatency), qint64(0));
+}
+
+void QFileCopierTest::testProgressSnapshot()
+{
+    QString key = "tst_qfilecopier_progress";
+    QVERIFY(copier.setSharedMemoryKey(key));
+    copier.copy(sourceFolder + "/file1.bin", destFolder);
+    copier.waitForFinished();
+
+    QFileCopier::ProgressSnapshot snapshot = copier.progressSnapshot();
+    QCOMPARE(snapshot.totalProgress, copier.totalProgress());
+    QCOMPARE(snapshot.totalSize, copier.totalSize());
+    QCOMPARE(snapshot.finishedFiles, snapshot.totalFiles);
+
+    QFileCopier::ProgressSnapshot shared;
+    QVERIFY(QFileCopier::readSharedProgress(key, &shared));
+    QCOMPARE(shared.totalProgress, snapshot.totalProgress);
+
+    QFileCopier other;
+    QVERIFY2(!other.setSharedMemoryKey(key), "Segment of another copier was taken over");
+    QVERIFY(copier.setSharedMemoryKey(QString()));
+}
+
+void QFileCopierTest::testEstimate()
+{
+    int progressInterval = copier.progressInterval();
+    copier.setProgressInterval(50);
+    QSignalSpy spy(&copier, SIGNAL(estimateChanged(qint64)));
+    QDir().mkpath(destFolder);
+    copier.copy(sourceFolder, destFolder + "/copy1");
+    copier.copy(sourceFolder, destFolder + "/copy2");
+
+    qint64 bytesRate = 0;
+    while (copier.state() != QFileCopier::Idle) {
+        QTest::qWait(20);
+        bytesRate = qMax(bytesRate, copier.bytesPerSecond());
+    }
+    copier.waitForFinished();
+    copier.setProgressInterval(progressInterval);
+
+    QList<qint64> estimates;
+    for (int i = 0; i < spy.size(); i++) {
+        qint64 estimate = spy.at(i).at(0).toLongLong();
+        if (estimate > 0)
+            estimates.append(estimate);
+    }
+    QVERIFY2(bytesRate > 0, "Rate was not measured");
+    QVERIFY2(estimates.size() >= 2, "Remaining time was not estimated");
+    QVERIFY2(estimates.last() < estimates.first(), "Remaining time did not go down");
+}
+
+void QFileCopierTest::testScratchDirectory()
+{
+    QFileCopier scratchCopier;
+    QVERIFY(scratchCopier.setScratchDirectory(QDir::tempPath()));
+    int job = scratchCopier.copy(sourceFolder, destFolder);
+    scratchCopier.waitForFinished();
+
+    QVERIFY2(exists(destFolder) && checkFiles(destFolder, 100), "Files were not copied");
+    int id = scratchCopier.jobRequests(job).first();
+    QCOMPARE(scratchCopier.destinationFilePath(id), QFileInfo(destFolder).absoluteFilePath());
+    QCOMPARE(scratchCopier.entryList(id).size(), QDir(sourceFolder).entryList(QDir::AllEntries | QDir::NoDotAndDotDot).size());
+
+    // requests are moved back to memory under the same ids
+    QVERIFY(scratchCopier.setScratchDirectory(QString()));
+    QCOMPARE(scratchCopier.destinationFilePath(id), QFileInfo(destFolder).absoluteFilePath());
+    QVERIFY(!scratchCopier.setScratchDirectory(QDir(sourceFolder).absoluteFilePath(QLatin1String("missing"))));
+    QCOMPARE(scratchCopier.scratchDirectory(), QString());
+}
+
+void QFileCopierTest::testBufferPool()
+{
+    int bufferSize = QFileCopier::bufferSize();
+    QFileCopier::setBufferSize(10000);
+    QCOMPARE(QFileCopier::bufferSize(), 12*1024); // whole pages
+    QFileCopier::setBufferMemoryLimit(1);
+    QCOMPARE(QFileCopier::bufferMemoryLimit(), qint64(12*1024)); // one buffer at least
+
+    copier.copy(sourceFolder, destFolder);
+    copier.waitForFinished();
+    QVERIFY2(exists(destFolder) && checkFiles(destFolder, 100), "Files were not copied");
+    removePath(destFolder);
+
+    // preempting request needs a buffer while the preempted one holds the only one
+    QSignalSpy started(&copier, SIGNAL(started(int)));
+    int job = copier.copy(sourceFolder, destFolder);
+    QList<int> startedIds;
+    while (startedIds.isEmpty() || !QFileInfo(copier.sourceFilePath(startedIds.last())).isFile()) {
+        QTest::qWait(10);
+        for (int i = startedIds.size(); i < started.size(); i++)
+            startedIds.append(started.at(i).at(0).toInt());
+    }
+    int top = copier.jobRequests(job).first();
+    int folder1 = childRequest(top, "folder1");
+    QList<int> candidates;
+    candidates << childRequest(top, "file1.bin") << childRequest(top, "file2.bin") << childRequest(folder1, "file11.bin");
+    foreach (int id, candidates) {
+        if (!startedIds.contains(id)) {
+            copier.setPriority(id, 1);
+            break;
+        }
+    }
+    copier.waitForFinished(60*1000);
+    QCoreApplication::processEvents();
+    bool finished = copier.state() == QFileCopier::Idle;
+
+    QFileCopier::setBufferSize(bufferSize);
+    QFileCopier::setBufferMemoryLimit(64*1024*1024); // wakes copier if it is stuck
+    if (!finished)
+        copier.waitForFinished();
+    QVERIFY2(finished, "Preempting request waited for a buffer forever");
+    QVERIFY2(exists(destFolder) && checkFiles(destFolder, 100), "Files were not copied");
+}
+
+void QFileCopierTest::testManifest()
+{
+    int job = copier.copy(sourceFolder, destFolder);
+    copier.waitForFinished();
+    QVERIFY2(exists(destFolder) && checkFiles(destFolder, 100), "Files were not copied");
+
+    QBuffer manifest;
+    manifest.open(QBuffer::ReadWrite);
+    QVERIFY(copier.saveManifest(job, &manifest));
+    QVERIFY(!copier.saveManifest(job + 1, &manifest));
+    removePath(destFolder);
+
+    manifest.seek(0);
+    int manifestJob = copier.executeManifest(&manifest, true);
+    QVERIFY(manifestJob != -1);
+    copier.waitForFinished();
+
+    QVERIFY2(exists(destFolder) && checkFiles(destFolder, 100), "Files were not copied from manifest");
+    QCOMPARE(copier.jobSize(manifestJob), copier.jobSize(job));
+    QCOMPARE(copier.entryList(copier.jobRequests(manifestJob).first()).size(),
+             copier.entryList(copier.jobRequests(job).first()).size());
+
+    QBuffer damaged;
+    damaged.setData(manifest.data().left(manifest.data().size() / 2));
+    damaged.open(QBuffer::ReadOnly);
+    QCOMPARE(copier.executeManifest(&damaged), -1);
+
+    // destination which appeared after saving is reported, not truncated
+    QString copied = destFolder + "/copied.bin";
+    job = copier.copy(sourceFolder + "/file1.bin", copied, QFileCopier::NonInteractive);
+    copier.waitForFinished();
+    QBuffer fileManifest;
+    fileManifest.open(QBuffer::ReadWrite);
+    QVERIFY(copier.saveManifest(job, &fileManifest));
+    QFile existing(copied);
+    QVERIFY(existing.open(QFile::WriteOnly));
+    existing.write("x");
+    existing.close();
+
+    QSignalSpy spy(&copier, SIGNAL(error(int,QFileCopier::Error,bool)));
+    fileManifest.seek(0);
+    QVERIFY(copier.executeManifest(&fileManifest) != -1);
+    copier.waitForFinished();
+    QCoreApplication::processEvents();
+    QCOMPARE(spy.count(), 1);
+    QCOMPARE(QFileInfo(copied).size(), qint64(1));
+}
+
+void QFileCopierTest::testList()
+{
+    QDir().mkpath(destFolder);
+    QBuffer list;
+    list.setData(QFile::encodeName(sourceFolder + "/file1.bin") + '\n'
+                 + QFile::encodeName(sourceFolder + "/folder1") + '\n');
+    list.open(QBuffer::ReadOnly);
+    int job = copier.copy(&list, destFolder);
+    copier.waitForFinished();
+
+    QCOMPARE(copier.jobRequests(job).size(), 2);
+    QVERIFY2(QFileInfo(destFolder + "/file1.bin").exists() && exists(destFolder + "/folder1", QStringList() << "file11.bin"), "Files were not copied");
+
+    QByteArray pairs = QFile::encodeName(sourceFolder + "/file1.bin");
+    pairs.append('\0');
+    pairs.append("renamed.bin");
+    pairs.append('\0');
+    QBuffer pairList(&pairs);
+    pairList.open(QBuffer::ReadOnly);
+    copier.copy(&pairList, destFolder, 0, QFileCopier::NulSeparated | QFileCopier::DestinationPairs);
+    copier.waitForFinished();
+
+    QCOMPARE(QFileInfo(destFolder + "/renamed.bin").size(), qint64(100*1024*1024));
+
+    // list is read in several batches, source left without destination is reported
+    QString smallFolder = destFolder + "/small";
+    QDir().mkpath(smallFolder);
+    QByteArray many;
+    for (int i = 0; i < 1100; i++) {
+        QFile small(smallFolder + "/" + QString::number(i));
+        QVERIFY(small.open(QFile::WriteOnly));
+        small.write("x");
+        many.append(QFile::encodeName(small.fileName()) + '\0');
+        many.append("copied" + QByteArray::number(i) + '\0');
+    }
+    many.append(QFile::encodeName(sourceFolder + "/file2.bin"));
+    QBuffer manyList(&many);
+    manyList.open(QBuffer::ReadOnly);
+    QSignalSpy spy(&copier, SIGNAL(error(int,QFileCopier::Error,bool)));
+    job = copier.copy(&manyList, destFolder, 0, QFileCopier::NulSeparated | QFileCopier::DestinationPairs);
+    copier.waitForFinished();
+    QCoreApplication::processEvents();
+
+    QCOMPARE(copier.jobRequests(job).size(), 1100);
+    QVERIFY2(QFileInfo(destFolder + "/copied0").exists() && QFileInfo(destFolder + "/copied1099").exists(), "Files were not copied");
+    QCOMPARE(spy.count(), 1);
+    QVERIFY2(copier.sourceFilePath(spy.first().at(0).toInt()).endsWith("file2.bin"), "Wrong source was reported");
+    QVERIFY2(!QFileInfo(destFolder + "/file2.bin").exists(), "Source without destination was copied");
+}
+
+void QFileCopierTest::testArchive()
+{
+    QDir().mkpath(destFolder);
+    QString archivePath = destFolder + "/source.tar";
+    int job = copier.archive(sourceFolder, archivePath);
+    copier.waitForFinished();
+
+    QCOMPARE(copier.destinationFilePath(copier.jobRequests(job).first()), sourceFolder);
+    QVERIFY2(!QFileInfo(destFolder + "/" + sourceFolder).exists(), "Files were copied instead of archiving");
+
+    // header and data padded to 512 bytes for each entry, two empty blocks at the end
+    qint64 entries = 1 + dirs.size() + files.size();
+    QCOMPARE(QFileInfo(archivePath).size(), entries*512 + qint64(files.size())*100*1024*1024 + 2*512);
+
+    QFile archive(archivePath);
+    QVERIFY(archive.open(QFile::ReadOnly));
+    QByteArray header = archive.read(512);
+    QCOMPARE(header.left(header.indexOf('\0')), QByteArray("source/"));
+    QCOMPARE(header.mid(257, 5), QByteArray("ustar"));
+}
+
+void QFileCopierTest::testFilters()
+{
+    copier.setExcludeFilters(QList<QRegExp>() << QRegExp("folder1?", Qt::CaseSensitive, QRegExp::Wildcard)
+                             << QRegExp("folder2", Qt::CaseSensitive, QRegExp::Wildcard));
+    copier.setIncludeFilters(QList<QRegExp>() << QRegExp("file\\d\\.bin"));
+    copier.copy(sourceFolder, destFolder);
+    copier.waitForFinished();
+
+    QVERIFY2(exists(destFolder, QStringList() << "file1.bin" << "file2.bin" << "folder1"), "Files were not copied");
+    QVERIFY2(!QFileInfo(destFolder + "/folder2").exists(), "Excluded folder was copied");
+    QVERIFY2(!QFileInfo(destFolder + "/folder1/folder11").exists(), "Excluded folder was copied");
+    QVERIFY2(!QFileInfo(destFolder + "/folder1/file11.bin").exists(), "Not included file was copied");
+    removePath(destFolder);
+
+    copier.clearFilters();
+    copier.setSizeFilter(0, 1024);
+    copier.copy(sourceFolder, destFolder);
+    copier.waitForFinished();
+    copier.clearFilters();
+
+    QVERIFY2(exists(destFolder, dirs), "Folders were not copied");
+    QVERIFY2(!QFileInfo(destFolder + "/file1.bin").exists(), "Too large file was copied");
+
+    // removed trees are not filtered
+    copier.setExcludeFilters(QList<QRegExp>() << QRegExp("folder2"));
+    copier.remove(destFolder);
+    copier.waitForFinished();
+    copier.clearFilters();
+    QVERIFY2(!QFileInfo(destFolder).exists(), "Excluded folder was not removed");
+}
+
+void QFileCopierTest::testMirror()
+{
+    copier.mirror(sourceFolder, destFolder);
+    copier.waitForFinished();
+    QVERIFY2(exists(destFolder) && checkFiles(destFolder, 100), "Files were not mirrored");
+
+    QVERIFY(QDir().mkpath(destFolder + "/extra"));
+    QFile extra(destFolder + "/extra.bin");
+    QVERIFY(extra.open(QFile::WriteOnly));
+    extra.close();
+    QVERIFY(QFile::resize(destFolder + "/file2.bin", 1));
+
+    int job = copier.mirror(sourceFolder, destFolder);
+    copier.waitForFinished();
+
+    QVERIFY2(exists(destFolder) && checkFiles(destFolder, 100), "Changed file was not mirrored");
+    QVERIFY2(!QFileInfo(destFolder + "/extra").exists() && !QFileInfo(destFolder + "/extra.bin").exists(), "Stale entries were not removed");
+    // two stale entries, changed file and both folders; unchanged file1.bin is skipped
+    QCOMPARE(copier.entryList(copier.jobRequests(job).first()).size(), 5);
+
+    // excluded entries are kept in stale directories, other entries are removed
+    QVERIFY(QDir().mkpath(destFolder + "/extra/kept"));
+    QVERIFY(QDir().mkpath(destFolder + "/extra/removed"));
+    copier.setExcludeFilters(QList<QRegExp>() << QRegExp("kept"));
+    copier.mirror(sourceFolder, destFolder);
+    copier.waitForFinished();
+    copier.clearFilters();
+    QVERIFY2(QFileInfo(destFolder + "/extra/kept").exists(), "Excluded entry was removed");
+    QVERIFY2(!QFileInfo(destFolder + "/extra/removed").exists(), "Stale entry was not removed");
+
+#ifdef Q_OS_UNIX
+    // stale link is removed itself even when links are followed, its target is not touched
+    QFile outside("outside.bin");
+    QVERIFY(outside.open(QFile::WriteOnly));
+    outside.close();
+    QVERIFY(QFile::link(QFileInfo(outside).absoluteFilePath(), destFolder + "/stale.lnk"));
+    copier.mirror(sourceFolder, destFolder, QFileCopier::FollowLinks);
+    copier.waitForFinished();
+    QVERIFY2(!QFileInfo(destFolder + "/stale.lnk").isSymLink(), "Stale link was not removed");
+    QVERIFY2(outside.exists(), "Target of stale link was removed");
+    outside.remove();
+#endif
+}
+
+void QFileCopierTest::testWatch()
+{
+#ifndef Q_OS_LINUX
+    QSKIP("Changes are only watched on Linux", SkipAll);
+#endif
+    int count = copier.count();
+    int watch = copier.watch(sourceFolder, destFolder);
+    copier.waitForFinished();
+    QVERIFY2(exists(destFolder) && checkFiles(destFolder, 100), "Files were not mirrored");
+
+    QVERIFY(QDir().mkpath(sourceFolder + "/folder3/folder31"));
+    QFile added(sourceFolder + "/folder3/folder31/added.bin");
+    QVERIFY(added.open(QFile::WriteOnly));
+    added.write(QByteArray(1024, 'a'));
+    added.close();
+    QFile changed(sourceFolder + "/watched.bin");
+    QVERIFY(changed.open(QFile::WriteOnly));
+    changed.close();
+
+    // delivery of events and coalescing take a while, so the expected state is polled for
+    QElapsedTimer timer;
+    timer.start();
+    while ((QFileInfo(destFolder + "/folder3/folder31/added.bin").size() != 1024
+            || !QFileInfo(destFolder + "/watched.bin").exists() || copier.state() != QFileCopier::Idle)
+           && timer.elapsed() < 10000)
+        QTest::qWait(50);
+    QVERIFY2(QFileInfo(destFolder + "/folder3/folder31/added.bin").size() == 1024, "New folder was not replicated");
+    QVERIFY2(QFileInfo(destFolder + "/watched.bin").exists(), "New file was not replicated");
+    QCOMPARE(copier.count(), count); // finished replication jobs are dropped
+
+    QVERIFY(QFile::remove(sourceFolder + "/watched.bin"));
+    QVERIFY(QFile::remove(sourceFolder + "/folder3/folder31/added.bin"));
+    QVERIFY(QDir().rmpath(sourceFolder + "/folder3/folder31"));
+
+    timer.restart();
+    while ((QFileInfo(destFolder + "/watched.bin").exists() || QFileInfo(destFolder + "/folder3").exists()
+            || copier.state() != QFileCopier::Idle) && timer.elapsed() < 10000)
+        QTest::qWait(50);
+    copier.stopWatching(watch);
+    QVERIFY2(!QFileInfo(destFolder + "/watched.bin").exists() && !QFileInfo(destFolder + "/folder3").exists(), "Removals were not replicated");
+    QVERIFY2(exists(destFolder) && checkFiles(destFolder, 100), "Unchanged files were touched");
+
+    QCOMPARE(copier.watch(sourceFolder, sourceFolder + "/replica"), -1);
+}
+
+void QFileCopierTest::testVerify()
+{
+    int job = copier.copy(sourceFolder, destFolder);
+    copier.waitForFinished();
+    QVERIFY2(exists(destFolder), "Files were not copied");
+
+    QSignalSpy spy(&copier, SIGNAL(error(int,QFileCopier::Error,bool)));
+    copier.verify(job);
+    copier.waitForFinished();
+    QCoreApplication::processEvents();
+    QCOMPARE(spy.count(), 0);
+
+    // same size, so only contents tell the difference
+    QFile changed(destFolder + "/folder1/file11.bin");
+    QVERIFY(changed.open(QFile::ReadWrite));
+    QVERIFY(changed.seek(50*1024*1024));
+    changed.write("x");
+    changed.close();
+
+    copier.verify(job);
+    copier.waitForFinished();
+    QCoreApplication::processEvents();
+    QCOMPARE(spy.count(), 1);
+    QVERIFY2(copier.destinationFilePath(spy.first().at(0).toInt()).endsWith("folder1/file11.bin"), "Wrong file was reported");
+
+#ifdef Q_OS_UNIX
+    // links copied as links differ if their targets do
+    QString linkPath = sourceFolder + "/file1.lnk";
+    QVERIFY(QFile::link(sourceFolder + "/file1.bin", linkPath));
+    int linkJob = copier.copy(linkPath, destFolder + "/file1.lnk");
+    copier.waitForFinished();
+    QFile::remove(linkPath);
+    QVERIFY(QFile::remove(destFolder + "/file1.lnk"));
+    QVERIFY(QFile::link(sourceFolder + "/file2.bin", destFolder + "/file1.lnk"));
+
+    spy.clear();
+    copier.verify(linkJob);
+    copier.waitForFinished();
+    QCoreApplication::processEvents();
+    QCOMPARE(spy.count(), 1);
+#endif
+}
+
+void QFileCopierTest::testPriority()
+{
+    QSignalSpy started(&copier, SIGNAL(started(int)));
+    QSignalSpy finished(&copier, SIGNAL(finished(int,bool)));
+    int job = copier.copy(sourceFolder, destFolder);
+    while (started.isEmpty())
+        QTest::qWait(10);
+
+    // whole tree is gathered when the top request is started
+    int top = copier.jobRequests(job).first();
+    int folder1 = childRequest(top, "folder1");
+    int folder11 = childRequest(folder1, "folder11");
+    int file111 = childRequest(folder11, "file111.bin");
+    copier.cancel(folder11);
+    copier.setPriority(folder1, 1);
+
+    bool folder11Finished = false;
+    while (!folder11Finished) {
+        QTest::qWait(10);
+        for (int i = 0; i < finished.size(); i++)
+            folder11Finished |= finished.at(i).at(0).toInt() == folder11;
+    }
+    // parent was canceled, so raising priority must not bring the file back
+    copier.setPriority(file111, 2);
+    copier.waitForFinished();
+    QCoreApplication::processEvents();
+
+    QList<int> order;
+    for (int i = 0; i < finished.size(); i++)
+        order.append(finished.at(i).at(0).toInt());
+    QVERIFY2(order.indexOf(childRequest(folder1, "file11.bin")) < order.indexOf(childRequest(top, "file2.bin")), "Priority was not raised");
+    QVERIFY2(!order.contains(file111) && !QFileInfo(destFolder + "/folder1/folder11/file111.bin").exists(), "File in canceled folder was copied");
+    QVERIFY2(exists(destFolder, QStringList() << "file1.bin" << "file2.bin" << "folder1/file11.bin"), "Files were not copied");
+}
+
+void QFileCopierTest::testPriority2()
+{
+    QSignalSpy started(&copier, SIGNAL(started(int)));
+    QSignalSpy jobFinished(&copier, SIGNAL(jobFinished(int,bool)));
+    QDir().mkpath(destFolder);
+    int job1 = copier.copy(sourceFolder, destFolder + "/copy");
+    int job2 = copier.copy(sourceFolder + "/file2.bin", destFolder + "/file2.bin");
+    while (started.isEmpty())
+        QTest::qWait(10);
+
+    // both jobs are gathered before anything is copied
+    QVERIFY(!copier.jobRequests(job2).isEmpty());
+    copier.setPriority(copier.jobRequests(job2).first(), 1);
+    copier.waitForFinished();
+    QCoreApplication::processEvents();
+
+    // job is finished as soon as its top request is copied, not when the other job is
+    QCOMPARE(jobFinished.size(), 2);
+    QCOMPARE(jobFinished.at(0).at(0).toInt(), job2);
+    QCOMPARE(jobFinished.at(1).at(0).toInt(), job1);
+    QVERIFY2(QFileInfo(destFolder + "/file2.bin").exists(), "File was not copied");
+}
+
+void QFileCopierTest::testCancelSubtree()
+{
+    QSignalSpy started(&copier, SIGNAL(started(int)));
+    QDir().mkpath(destFolder);
+    int job = copier.copy(sourceFolder, destFolder + "/copy1");
+    while (started.isEmpty())
+        QTest::qWait(10);
+
+    // subtree which was not started yet is skipped, its siblings are copied
+    int top = copier.jobRequests(job).first();
+    int folder1 = childRequest(top, "folder1");
+    copier.cancel(childRequest(folder1, "folder11"));
+    copier.waitForFinished();
+
+    QVERIFY2(exists(destFolder + "/copy1", QStringList() << "file1.bin" << "file2.bin" << "folder1/file11.bin"), "Siblings were not copied");
+    QVERIFY2(!QFileInfo(destFolder + "/copy1/folder1/folder11").exists(), "Canceled subtree was copied");
+
+    // descendants of directory being copied were gathered already and are canceled with it
+    started.clear();
+    job = copier.copy(sourceFolder, destFolder + "/copy2");
+    while (started.isEmpty())
+        QTest::qWait(10);
+    top = copier.jobRequests(job).first();
+    folder1 = childRequest(top, "folder1");
+    int file11 = childRequest(folder1, "file11.bin");
+    bool file11Started = false;
+    while (!file11Started) {
+        QTest::qWait(10);
+        for (int i = 0; i < started.size(); i++)
+            file11Started |= started.at(i).at(0).toInt() == file11;
+    }
+    copier.cancel(folder1);
+    copier.waitForFinished();
+
+    QVERIFY2(exists(destFolder + "/copy2", QStringList() << "file1.bin" << "file2.bin"), "Siblings were not copied");
+    QVERIFY2(!QFileInfo(destFolder + "/copy2/folder1/folder11").exists(), "Descendants of canceled folder were copied");
+}
+
 void QFileCopierTest::createFiles(const QString &folder, int mb)
 {
     QDir().mkpath(folder);
@@ -209,6 +890,15 @@ bool QFileCopierTest::checkFiles(const QString &folder, int expectedSize)
     return true;
 }
 
+int QFileCopierTest::childRequest(int id, const QString &name)
+{
+    foreach (int child, copier.entryList(id)) {
+        if (QFileInfo(copier.sourceFilePath(child)).fileName() == name)
+            return child;
+    }
+    return -1;
+}
+
 QTEST_MAIN(QFileCopierTest)
 
 #include "tst_qfilecopiertest.moc"
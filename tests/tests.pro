@@ -3,6 +3,7 @@ TEMPLATE = subdirs
 SUBDIRS += \
     copiertest \
     notificationtest \
-    qfilecopier_tst
+    qfilecopier_tst \
+    qfilecopier_bench
 
 